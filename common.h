@@ -8,14 +8,16 @@
 #define STREAM_BUFFER_BITS 9
 #endif
 
-#define TINF_ADLER32 0
-#define TINF_CRC32 0
-#define TINF_ZLIB 0
-#define TINF_GZIP 0
+#define TINF_ADLER32 1
+#define TINF_CRC32 1
+#define TINF_ZLIB 1
+#define TINF_GZIP 1
 #define TINF_STREAM 1
 #define TINF_BUFFER 1
 #define TINF_ASSERT assert
+#ifndef TINF_STREAM_BUFFER_SIZE
 #define TINF_STREAM_BUFFER_SIZE (1<<(STREAM_BUFFER_BITS))
+#endif
 #define TINFLATE_IMPLEMENTATION
 
 #include "tinf_sf.h"
@@ -28,54 +28,1649 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 
 #define STREAM_BUFFER_BITS 15
+#define TINF_PUSH 1
+// Each worker brings its own history buffer, which tinf is pointed at with
+// the -w window for every file, instead of one inside struct tinf_data.
+#define TINF_STREAM_BUFFER_SIZE 0
+
+// The analyzer (-a) watches the decoder through tinf's hooks. Its state is
+// hung off the context's opaque pointer, which push mode doesn't use, so
+// every other decode skips straight past them.
+struct analysis;
+static void analyze_block( struct analysis * a, int btype );
+static void analyze_literal( struct analysis * a );
+static void analyze_match( struct analysis * a, int length, unsigned int offs );
+#define TINF_ON_BLOCK( d, btype ) do { if( (d)->opaque ) analyze_block( (struct analysis*)(d)->opaque, btype ); } while( 0 )
+#define TINF_ON_LITERAL( d, c ) do { if( (d)->opaque ) analyze_literal( (struct analysis*)(d)->opaque ); } while( 0 )
+#define TINF_ON_MATCH( d, length, offs ) do { if( (d)->opaque ) analyze_match( (struct analysis*)(d)->opaque, length, offs ); } while( 0 )
 
 #include "common.h"
+#include "rtgz_opt.h"
+
+// tdefl is built for the largest window and limited to -w at run time.
+#define TDEFL_STREAM 1
+#define TDEFL_BUFFER 0
+#define TDEFL_WINDOW_SIZE 32768
+#define TDEFL_IMPLEMENTATION
+#include "tdefl_sf.h"
 #include <zlib.h>
 
-// From zpipe
-#define CHUNK 16384
+// Buffer size for reads and writes, large so syscalls don't dominate.
+#define IO_CHUNK (1<<20)
+
+// Longest run handed to zlib or tinf at once from a mapped input, it has to
+// fit their unsigned int lengths.
+#define MAP_RUN (1<<30)
+
+#define ENGINE_ZLIB 0
+#define ENGINE_TINF 1
+#define ENGINE_TINFBUF 2
+#define ENGINE_TDEFL 3
+
+struct filegroup
+{
+	FILE * fRead;
+	FILE * fWrite;
+	const uint8_t * map; // Whole input, if it is a regular file
+	size_t maplen;
+	size_t mappos;
+};
+
+// Map the input if it is a regular file, so it can be used in place.
+// Anything else (pipes, terminals, empty files) keeps using fread.
+static void map_input( struct filegroup * fg )
+{
+	struct stat st;
+	void * m;
+
+	fg->map = 0;
+	fg->maplen = 0;
+	fg->mappos = 0;
+
+	if( fstat( fileno( fg->fRead ), &st ) || !S_ISREG( st.st_mode ) || st.st_size <= 0 )
+		return;
+
+	m = mmap( 0, st.st_size, PROT_READ, MAP_PRIVATE, fileno( fg->fRead ), 0 );
+	if( m == MAP_FAILED )
+		return;
+
+	madvise( m, st.st_size, MADV_SEQUENTIAL );
+	fg->map = m;
+	fg->maplen = st.st_size;
+}
+
+// Return the next run of at most `cap` input bytes and store its length in
+// `len`, 0 at the end. Mapped input is returned in place, otherwise it is
+// read into `buf`. Returns NULL on a read error.
+static const uint8_t * input_next( struct filegroup * fg, uint8_t * buf, size_t cap, size_t * len )
+{
+	if( fg->map )
+	{
+		const uint8_t * p = fg->map + fg->mappos;
+		*len = fg->maplen - fg->mappos < cap ? fg->maplen - fg->mappos : cap;
+		fg->mappos += *len;
+		return p;
+	}
+
+	*len = fread( buf, 1, cap, fg->fRead );
+	return ferror( fg->fRead ) ? 0 : buf;
+}
+
+static int input_done( struct filegroup * fg )
+{
+	return fg->map ? fg->mappos == fg->maplen : feof( fg->fRead );
+}
+
+// What one file took, for -v and --stats. Reads and writes are timed as
+// they happen and the codec is charged with the rest, so with a mapped
+// input the page faults count as codec time.
+struct rtgzstats
+{
+	uint64_t bytesin;
+	uint64_t bytesout;
+	uint64_t reads;
+	uint64_t writes;
+	uint64_t chunks; // Parallel compression chunks
+	int mapped; // Input read through page faults, not read()
+	double readwall, readcpu;
+	double writewall, writecpu;
+	double wall, cpu;
+	double workercpu; // Spent on compression threads
+	int zchecked;
+	uint64_t ztotalin, ztotalout;
+};
+
+static double wall_time( void )
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Per thread, so batch workers don't see each other's time.
+static double cpu_time( void )
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_THREAD_CPUTIME_ID, &ts );
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static const uint8_t * read_input( struct rtgzstats * st, struct filegroup * fg, uint8_t * buf, size_t cap, size_t * len )
+{
+	double wall = wall_time(), cpu = cpu_time();
+	const uint8_t * p = input_next( fg, buf, cap, len );
+	st->readwall += wall_time() - wall;
+	st->readcpu += cpu_time() - cpu;
+	if( p )
+	{
+		st->reads++;
+		st->bytesin += *len;
+	}
+	return p;
+}
+
+static int write_output( struct rtgzstats * st, struct filegroup * fg, const void * p, size_t n )
+{
+	double wall = wall_time(), cpu = cpu_time();
+	size_t r = fwrite( p, 1, n, fg->fWrite );
+	st->writewall += wall_time() - wall;
+	st->writecpu += cpu_time() - cpu;
+	st->writes++;
+	st->bytesout += r;
+	return r == n && !ferror( fg->fWrite ) ? 0 : -1;
+}
+
+struct pjob
+{
+	pthread_t thread;
+	int level;
+	int windowsize;
+	int last;
+	const uint8_t * dict;
+	size_t dictlen;
+	uint8_t * inbuf;
+	const uint8_t * in; // inbuf, or straight from the mapped input
+	size_t inlen;
+	uint8_t * out;
+	size_t outcap;
+	size_t outlen;
+	uint64_t totalin, totalout; // As zlib counted them
+	double cpu;
+	int ret;
+};
+
+// Deflate one chunk on its own. Every chunk but the last ends with a sync
+// flush, so it finishes on a byte boundary without a final block, and the
+// outputs can simply be concatenated.
+static void * compress_chunk( void * v )
+{
+	struct pjob * j = (struct pjob*)v;
+	z_stream stream = { 0 };
+	double cpu = cpu_time();
+
+	j->ret = deflateInit2( &stream, j->level, Z_DEFLATED, -j->windowsize, MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY );
+	if( j->ret != Z_OK )
+		return 0;
+
+	// Priming with the end of the previous chunk keeps matches across the
+	// seam, and they never reach further back than the window.
+	if( j->dictlen )
+		deflateSetDictionary( &stream, j->dict, j->dictlen );
+
+	stream.next_in = (Bytef*)j->in;
+	stream.avail_in = j->inlen;
+	stream.next_out = j->out;
+	stream.avail_out = j->outcap;
+	j->ret = deflate( &stream, j->last ? Z_FINISH : Z_SYNC_FLUSH );
+	j->outlen = j->outcap - stream.avail_out;
+
+	if( j->ret == ( j->last ? Z_STREAM_END : Z_OK ) && stream.avail_in == 0 && stream.avail_out != 0 )
+		j->ret = Z_OK;
+	else if( j->ret == Z_OK )
+		j->ret = Z_BUF_ERROR;
+
+	// Setting the dictionary counts it as input.
+	j->totalin = stream.total_in - j->dictlen;
+	j->totalout = stream.total_out;
+	deflateEnd( &stream );
+	j->cpu = cpu_time() - cpu;
+	return 0;
+}
+
+// Compress with a pool of `threads` workers, `chunksize` bytes at a time.
+static int compress_parallel( struct filegroup * fg, int level, int windowsize, int threads, size_t chunksize, const uint8_t * preset, size_t presetlen, struct rtgzstats * st )
+{
+	struct pjob * jobs = calloc( threads, sizeof( struct pjob ) );
+	size_t dictcap = (size_t)1 << windowsize;
+	uint8_t * dict = malloc( dictcap );
+	size_t dictlen = 0;
+	z_stream sizer = { 0 };
+	size_t outcap;
+	int done = 0;
+	int ret = 0;
+	int i;
+
+	if( !jobs || !dict )
+	{
+		fprintf( stderr, "Error: out of memory\n" );
+		ret = -9;
+		goto cleanup;
+	}
+
+	if( deflateInit2( &sizer, level, Z_DEFLATED, -windowsize, MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY ) != Z_OK )
+	{
+		fprintf( stderr, "Error: deflateInit2() failed\n" );
+		ret = -12;
+		goto cleanup;
+	}
+	// Room for the sync flush's empty stored block on top of the bound.
+	outcap = deflateBound( &sizer, chunksize ) + 16;
+	deflateEnd( &sizer );
+
+	// The first chunk is primed with the preset dictionary, if there is one.
+	dictlen = presetlen < dictcap ? presetlen : dictcap;
+	if( dictlen )
+		memcpy( dict, preset + presetlen - dictlen, dictlen );
+
+	for( i = 0; i < threads; i++ )
+	{
+		jobs[i].level = level;
+		jobs[i].windowsize = windowsize;
+		jobs[i].inbuf = fg->map ? 0 : malloc( chunksize );
+		jobs[i].out = malloc( outcap );
+		jobs[i].outcap = outcap;
+		if( ( !fg->map && !jobs[i].inbuf ) || !jobs[i].out )
+		{
+			fprintf( stderr, "Error: out of memory\n" );
+			ret = -9;
+			goto cleanup;
+		}
+	}
+
+	while( !done )
+	{
+		int n;
+
+		// Read a chunk per worker. A short read means it is the last one,
+		// which may be empty and then only holds the final block.
+		for( n = 0; n < threads && !done; n++ )
+		{
+			struct pjob * j = &jobs[n];
+			j->in = read_input( st, fg, j->inbuf, chunksize, &j->inlen );
+			if( !j->in )
+			{
+				fprintf( stderr, "Error: read failure on in file\n" );
+				ret = -13;
+				goto cleanup;
+			}
+			st->chunks++;
+			done = j->last = j->inlen < chunksize;
+
+			if( n == 0 )
+			{
+				j->dict = dict;
+				j->dictlen = dictlen;
+			}
+			else
+			{
+				j->dictlen = jobs[n-1].inlen < dictcap ? jobs[n-1].inlen : dictcap;
+				j->dict = jobs[n-1].in + jobs[n-1].inlen - j->dictlen;
+			}
+		}
+
+		for( i = 0; i < n; i++ )
+		{
+			if( pthread_create( &jobs[i].thread, 0, compress_chunk, &jobs[i] ) )
+			{
+				fprintf( stderr, "Error: can't start compression thread\n" );
+				ret = -14;
+				break;
+			}
+		}
+
+		// Wait for every worker that did start, even if a later one failed,
+		// since they still use jobs and dict.
+		while( i-- )
+		{
+			pthread_join( jobs[i].thread, 0 );
+		}
+		if( ret )
+			goto cleanup;
+
+		for( i = 0; i < n; i++ )
+		{
+			if( jobs[i].ret != Z_OK )
+			{
+				fprintf( stderr, "Error: Error compressing block (%d)\n", jobs[i].ret );
+				ret = -12;
+				goto cleanup;
+			}
+			st->ztotalin += jobs[i].totalin;
+			st->ztotalout += jobs[i].totalout;
+			st->workercpu += jobs[i].cpu;
+			if( write_output( st, fg, jobs[i].out, jobs[i].outlen ) )
+			{
+				fprintf( stderr, "Error: Error writing compressed data\n" );
+				ret = -12;
+				goto cleanup;
+			}
+		}
+
+		// The buffers get reused, so keep the tail for the next batch.
+		dictlen = jobs[n-1].inlen < dictcap ? jobs[n-1].inlen : dictcap;
+		memcpy( dict, jobs[n-1].in + jobs[n-1].inlen - dictlen, dictlen );
+	}
+
+	st->zchecked = 1;
+
+cleanup:
+	for( i = 0; jobs && i < threads; i++ )
+	{
+		free( jobs[i].inbuf );
+		free( jobs[i].out );
+	}
+	free( jobs );
+	free( dict );
+	return ret;
+}
+
+static const char * tinf_error_string( int r )
+{
+	switch( r )
+	{
+	case TINF_DATA_ERROR: return "data error";
+	case TINF_BUF_ERROR: return "buffer error";
+	case TINF_STREAM_ERROR: return "stream needs a larger window than -w";
+	case TINF_NEED_INPUT: return "truncated stream";
+	default: return "unknown error";
+	}
+}
+
+struct rtgzopts
+{
+	int operation; // 1 compress, 2 decompress, 3 analyze
+	int windowsize;
+	int compresslevel;
+	int verbose;
+	int engine;
+	int threads;
+	size_t chunksize;
+	int stats; // 1 human readable, 2 JSON
+	int optimal;
+	const char * indexfile; // -x, access point index
+	int ranged; // Decompress only rangestart, rangelen bytes
+	uint64_t rangestart;
+	uint64_t rangelen;
+	const uint8_t * dict; // -D preset dictionary, at most a 32 KiB window
+	size_t dictlen;
+};
+
+// Buffers and codec state that are kept from one file to the next, so in
+// batch mode they are only set up once per worker.
+struct rtgzworker
+{
+	uint8_t * in;
+	uint8_t * out;
+	z_stream deflater;
+	int deflater_ready;
+	uLong dictbase; // deflater total_in before the first real input byte
+	z_stream inflater;
+	int inflater_ready;
+	struct tinf_data * tinf;
+	uint8_t * history; // tinf's history buffer, big enough for any -w
+};
+
+static int worker_init( struct rtgzworker * w )
+{
+	memset( w, 0, sizeof( *w ) );
+	w->in = malloc( IO_CHUNK );
+	w->out = malloc( IO_CHUNK );
+	w->tinf = malloc( sizeof( struct tinf_data ) );
+	w->history = malloc( 1 << STREAM_BUFFER_BITS );
+	if( !w->in || !w->out || !w->tinf || !w->history )
+	{
+		fprintf( stderr, "Error: out of memory\n" );
+		return -9;
+	}
+	return 0;
+}
+
+static void worker_free( struct rtgzworker * w )
+{
+	if( w->deflater_ready ) deflateEnd( &w->deflater );
+	if( w->inflater_ready ) inflateEnd( &w->inflater );
+	free( w->in );
+	free( w->out );
+	free( w->tinf );
+	free( w->history );
+}
+
+static int deflater_start( const struct rtgzopts * o, struct rtgzworker * w )
+{
+	z_stream * stream = &w->deflater;
+	int ret;
+
+	if( w->deflater_ready )
+	{
+		ret = deflateReset( stream );
+	}
+	else
+	{
+		memset( stream, 0, sizeof( *stream ) );
+		ret = deflateInit2( stream, o->compresslevel, Z_DEFLATED, -o->windowsize, MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY );
+		w->deflater_ready = ( ret == Z_OK );
+	}
+	if( ret == Z_OK && o->dictlen )
+		ret = deflateSetDictionary( stream, o->dict, o->dictlen );
+	if (ret != Z_OK)
+		fprintf( stderr, "Error: deflateInit2() = %d\n", ret );
+	// zlib counts the part of the dictionary it took as input.
+	w->dictbase = stream->total_in;
+	return ret;
+}
+
+static int compress_zlib( const struct rtgzopts * o, struct rtgzworker * w, struct filegroup * fg, struct rtgzstats * st )
+{
+	int ret, flush;
+	unsigned have;
+	z_stream * stream = &w->deflater;
+
+	// Compress( deflate )
+	ret = deflater_start( o, w );
+	if (ret != Z_OK)
+		return ret;
+
+	do
+	{
+		size_t len;
+		const uint8_t * run = read_input( st, fg, w->in, fg->map ? MAP_RUN : IO_CHUNK, &len );
+		if ( !run )
+		{
+			fprintf( stderr, "Error: read failure on in file\n" );
+			return -13;
+		}
+		stream->avail_in = len;
+		flush = input_done( fg ) ? Z_FINISH : Z_NO_FLUSH;
+		stream->next_in = (Bytef*)run;
+
+		/* run deflate() on input until output buffer not full, finish
+		compression if all of source has been read in */
+		do {
+			stream->avail_out = IO_CHUNK;
+			stream->next_out = w->out;
+			ret = deflate(stream, flush);    /* no bad return value */
+			if( ret == Z_STREAM_ERROR )
+			{
+				fprintf( stderr, "Error: Error compressing block\n" );
+				return -12;
+			}
+
+			have = IO_CHUNK - stream->avail_out;
+			if ( write_output( st, fg, w->out, have ) )
+			{
+				fprintf( stderr, "Error: Error writing compressed data\n" );
+				return -12;
+			}
+		} while (stream->avail_out == 0);
+		if( stream->avail_in != 0 )
+		{
+			fprintf( stderr, "Error: Stream ended prematurely\n" );
+		}
+	} while (flush != Z_FINISH);
+
+	if( ret != Z_STREAM_END )
+	{
+		fprintf( stderr, "stream not ended\n" );
+		return -6;
+	}
+	st->zchecked = 1;
+	st->ztotalin = stream->total_in - w->dictbase;
+	st->ztotalout = stream->total_out;
+	return 0;
+}
+
+// Access point index (-x): "RZX1", then an entry per access point, each
+// two LEB128 numbers: how far the decompressed offset and the compressed
+// offset in bits moved since the entry before. The first entry is the start
+// of the stream and the last one is its end, which is not an access point.
+static int write_index( const char * path, const struct tinf_access_point * pts, size_t n )
+{
+	FILE * f = fopen( path, "wb" );
+	uint64_t out = 0, bit = 0;
+	size_t i;
+
+	if( !f )
+		return -1;
+	fputs( "RZX1", f );
+	for( i = 0; i < n; i++ )
+	{
+		uint64_t v[2] = { pts[i].out_offset - out, (uint64_t)pts[i].in_offset * 8 + pts[i].in_bits - bit };
+		int k;
+		for( k = 0; k < 2; k++ )
+		{
+			while( v[k] >= 0x80 )
+			{
+				fputc( ( v[k] & 0x7f ) | 0x80, f );
+				v[k] >>= 7;
+			}
+			fputc( v[k], f );
+		}
+		out = pts[i].out_offset;
+		bit = (uint64_t)pts[i].in_offset * 8 + pts[i].in_bits;
+	}
+	i = ferror( f );
+	return ( fclose( f ) || i ) ? -1 : 0;
+}
+
+static int read_varint( FILE * f, uint64_t * v )
+{
+	int c, shift = 0;
+	*v = 0;
+	do
+	{
+		c = fgetc( f );
+		if( c == EOF || shift > 63 )
+			return -1;
+		*v |= (uint64_t)( c & 0x7f ) << shift;
+		shift += 7;
+	} while( c & 0x80 );
+	return 0;
+}
+
+// Returns the number of entries, or -1 if the file is missing or broken.
+static long read_index( const char * path, struct tinf_access_point ** pts )
+{
+	FILE * f = fopen( path, "rb" );
+	char magic[4];
+	uint64_t out = 0, bit = 0, dout, dbit;
+	long n = 0;
+
+	*pts = 0;
+	if( !f )
+		return -1;
+	if( fread( magic, 1, 4, f ) != 4 || memcmp( magic, "RZX1", 4 ) )
+	{
+		fclose( f );
+		return -1;
+	}
+	while( read_varint( f, &dout ) == 0 )
+	{
+		struct tinf_access_point * grown;
+		if( read_varint( f, &dbit ) )
+			break;
+		grown = realloc( *pts, sizeof( **pts ) * ( n + 1 ) );
+		if( !grown )
+			break;
+		*pts = grown;
+		out += dout;
+		bit += dbit;
+		grown[n].out_offset = out;
+		grown[n].in_offset = bit >> 3;
+		grown[n].in_bits = bit & 7;
+		n++;
+	}
+	if( !feof( f ) || n < 2 )
+	{
+		free( *pts );
+		*pts = 0;
+		n = -1;
+	}
+	fclose( f );
+	return n;
+}
+
+static int add_access_point( struct tinf_access_point ** pts, size_t * n, const z_stream * stream, uLong base )
+{
+	struct tinf_access_point * grown = realloc( *pts, sizeof( **pts ) * ( *n + 1 ) );
+	if( !grown )
+		return -1;
+	*pts = grown;
+	grown[*n].out_offset = stream->total_in - base;
+	grown[*n].in_offset = stream->total_out;
+	grown[*n].in_bits = 0;
+	(*n)++;
+	return 0;
+}
+
+// Like compress_zlib, but with a full flush every -b bytes of input. Each
+// one empties the history and byte aligns the output, so decoding can start
+// there, and it goes in the -x index.
+static int compress_indexed( const struct rtgzopts * o, struct rtgzworker * w, struct filegroup * fg, struct rtgzstats * st )
+{
+	z_stream * stream = &w->deflater;
+	struct tinf_access_point * pts = 0;
+	size_t npts = 0, untilflush = o->chunksize;
+	int ret = deflater_start( o, w ), flush;
+
+	if( ret != Z_OK )
+		return ret;
+	if( add_access_point( &pts, &npts, stream, w->dictbase ) )
+	{
+		fprintf( stderr, "Error: out of memory\n" );
+		return -9;
+	}
+
+	do
+	{
+		size_t len;
+		const uint8_t * run = read_input( st, fg, w->in, fg->map ? MAP_RUN : IO_CHUNK, &len );
+		int last = input_done( fg );
+		if( !run )
+		{
+			fprintf( stderr, "Error: read failure on in file\n" );
+			free( pts );
+			return -13;
+		}
+
+		do
+		{
+			size_t n = len < untilflush ? len : untilflush;
+			flush = ( last && n == len ) ? Z_FINISH : n == untilflush ? Z_FULL_FLUSH : Z_NO_FLUSH;
+			stream->next_in = (Bytef*)run;
+			stream->avail_in = n;
+			do
+			{
+				stream->avail_out = IO_CHUNK;
+				stream->next_out = w->out;
+				ret = deflate( stream, flush );
+				if( ret == Z_STREAM_ERROR || write_output( st, fg, w->out, IO_CHUNK - stream->avail_out ) )
+				{
+					fprintf( stderr, "Error: Error compressing block\n" );
+					free( pts );
+					return -12;
+				}
+			} while( stream->avail_out == 0 );
+			run += n;
+			len -= n;
+			untilflush -= n;
+
+			if( flush == Z_FULL_FLUSH )
+			{
+				if( add_access_point( &pts, &npts, stream, w->dictbase ) )
+				{
+					fprintf( stderr, "Error: out of memory\n" );
+					free( pts );
+					return -9;
+				}
+				untilflush = o->chunksize;
+			}
+		} while( len );
+	} while( flush != Z_FINISH );
+
+	if( ret != Z_STREAM_END )
+	{
+		fprintf( stderr, "stream not ended\n" );
+		free( pts );
+		return -6;
+	}
+	st->zchecked = 1;
+	st->ztotalin = stream->total_in - w->dictbase;
+	st->ztotalout = stream->total_out;
+
+	// The end of the stream closes the index.
+	ret = 0;
+	if( add_access_point( &pts, &npts, stream, w->dictbase ) || write_index( o->indexfile, pts, npts ) )
+	{
+		fprintf( stderr, "Error: can't write index %s\n", o->indexfile );
+		ret = -12;
+	}
+	free( pts );
+	return ret;
+}
+
+static int decompress_zlib( const struct rtgzopts * o, struct rtgzworker * w, struct filegroup * fg, struct rtgzstats * st )
+{
+	z_stream * strm = &w->inflater;
+	int ret;
+	int have = 0;
+
+	if( w->inflater_ready )
+	{
+		ret = inflateReset( strm );
+	}
+	else
+	{
+		memset( strm, 0, sizeof( *strm ) );
+		ret = inflateInit2( strm, -o->windowsize ); //const char *version, int stream_size);
+		w->inflater_ready = ( ret == Z_OK );
+	}
+	if( ret == Z_OK && o->dictlen )
+		ret = inflateSetDictionary( strm, o->dict, o->dictlen );
+
+	if (ret != Z_OK)
+	{
+		fprintf( stderr, "Error: inflateInit() fault %d\n", ret );
+		return ret;
+	}
+
+	do {
+		size_t len;
+		const uint8_t * run = read_input( st, fg, w->in, fg->map ? MAP_RUN : IO_CHUNK, &len );
+		if (!run) {
+			fprintf( stderr, "Error: reading from input file\n" );
+			return Z_ERRNO;
+		}
+
+		strm->avail_in = len;
+		if (strm->avail_in == 0)
+			break;
+		strm->next_in = (Bytef*)run;
+
+		/* run inflate() on input until output buffer not full */
+		do {
+			strm->avail_out = IO_CHUNK;
+			strm->next_out = w->out;
+			ret = inflate(strm, Z_NO_FLUSH);
+			switch (ret) {
+				case Z_NEED_DICT:
+					ret = Z_DATA_ERROR;     /* and fall through */
+				case Z_DATA_ERROR:
+				case Z_MEM_ERROR:
+					fprintf( stderr, "Error: zlib error: %d\n", ret );
+					return ret;
+				default:
+					break;
+			}
+			have = IO_CHUNK - strm->avail_out;
+			if (write_output(st, fg, w->out, have)) {
+				fprintf( stderr, "Error: error writing to output file\n" );
+				return Z_ERRNO;
+			}
+		} while (strm->avail_out == 0);
+
+		/* done when inflate() says it's done */
+	} while (ret != Z_STREAM_END);
+
+	if( ret != Z_STREAM_END )
+	{
+		fprintf( stderr, "Error: inflateEnd error\n" );
+		return -44;
+	}
+	st->zchecked = 1;
+	st->ztotalin = strm->total_in;
+	st->ztotalout = strm->total_out;
+	return 0;
+}
+
+// Compress with the optimal parser in rtgz_opt.h, which wants the whole
+// input at once.
+static int compress_optimal( const struct rtgzopts * o, struct filegroup * fg, struct rtgzstats * st )
+{
+	size_t inlen = 0, incap = IO_CHUNK;
+	uint8_t * inbuf = fg->map ? 0 : malloc( incap );
+	const uint8_t * in = fg->map;
+	uint8_t * out = 0;
+	size_t outlen;
+	int ret = 0;
+
+	if( fg->map )
+	{
+		inlen = fg->maplen;
+		st->bytesin = inlen;
+	}
+
+	while( inbuf )
+	{
+		size_t len;
+		uint8_t * grown;
+		if( !read_input( st, fg, inbuf + inlen, incap - inlen, &len ) )
+		{
+			fprintf( stderr, "Error: reading input file\n" );
+			free( inbuf );
+			return Z_ERRNO;
+		}
+		inlen += len;
+		if( inlen < incap )
+		{
+			in = inbuf;
+			break;
+		}
+		incap *= 2;
+		grown = realloc( inbuf, incap );
+		if( !grown )
+			free( inbuf );
+		inbuf = grown;
+	}
+
+	if( !in || inlen > 0x7fffffff )
+	{
+		fprintf( stderr, "Error: input too large for -O\n" );
+		free( inbuf );
+		return -9;
+	}
+
+	if( rtgz_opt_compress( in, inlen, o->windowsize, &out, &outlen ) )
+	{
+		fprintf( stderr, "Error: out of memory\n" );
+		ret = -9;
+	}
+	else if( write_output( st, fg, out, outlen ) )
+	{
+		fprintf( stderr, "Error: Error writing compressed data\n" );
+		ret = -12;
+	}
+
+	free( inbuf );
+	free( out );
+	return ret;
+}
+
+// Hands tdefl one byte at a time, the way a device would feed it.
+struct tdeflio
+{
+	struct filegroup * fg;
+	struct rtgzstats * st;
+	struct rtgzworker * w;
+	const uint8_t * in;
+	size_t inpos, inlen;
+	size_t outlen;
+	int err;
+};
+
+static int tdefl_feed( void * opaque )
+{
+	struct tdeflio * t = opaque;
+	if( t->inpos == t->inlen )
+	{
+		t->in = read_input( t->st, t->fg, t->w->in, t->fg->map ? MAP_RUN : IO_CHUNK, &t->inlen );
+		t->inpos = 0;
+		if( !t->in )
+		{
+			t->err = 1;
+			t->inlen = 0;
+		}
+		if( t->inlen == 0 )
+			return -1;
+	}
+	return t->in[t->inpos++];
+}
+
+static int tdefl_produce( void * opaque, uint8_t c )
+{
+	struct tdeflio * t = opaque;
+	t->w->out[t->outlen++] = c;
+	if( t->outlen == IO_CHUNK )
+	{
+		if( write_output( t->st, t->fg, t->w->out, t->outlen ) )
+			return -1;
+		t->outlen = 0;
+	}
+	return 0;
+}
+
+// Compress with tdefl, the small encoder meant to run on the device itself.
+static int compress_tdefl( const struct rtgzopts * o, struct rtgzworker * w, struct filegroup * fg, struct rtgzstats * st )
+{
+	struct tdeflio t = { fg, st, w, 0, 0, 0, 0, 0 };
+	int r = tdefl_stream_compress_window( tdefl_feed, tdefl_produce, &t, o->windowsize );
+
+	if( t.err )
+	{
+		fprintf( stderr, "Error: reading input file\n" );
+		return Z_ERRNO;
+	}
+	if( r != TDEFL_OK || write_output( st, fg, w->out, t.outlen ) )
+	{
+		fprintf( stderr, "Error: Error writing compressed data\n" );
+		return -12;
+	}
+	return 0;
+}
+
+// Decode with tinf in push mode, with a history buffer of just the -w
+// window, so it fails like a device built with that STREAM_BUFFER_BITS would.
+static int tinf_push_all( struct rtgzworker * w, struct filegroup * fg, struct rtgzstats * st )
+{
+	const uint8_t * in = 0;
+	size_t inpos = 0, inlen = 0;
+	int r = TINF_NEED_INPUT;
+
+	while( r == TINF_NEED_INPUT || r == TINF_NEED_OUTPUT )
+	{
+		unsigned int consumed, produced;
+
+		if( r == TINF_NEED_INPUT )
+		{
+			in = read_input( st, fg, w->in, fg->map ? MAP_RUN : IO_CHUNK, &inlen );
+			inpos = 0;
+			if( !in )
+			{
+				fprintf( stderr, "Error: reading input file\n" );
+				return Z_ERRNO;
+			}
+			if( inlen == 0 )
+				break;
+		}
+
+		r = tinf_stream_push( w->tinf, in + inpos, inlen - inpos, w->out, IO_CHUNK, &consumed, &produced );
+		inpos += consumed;
+
+		if( write_output( st, fg, w->out, produced ) )
+		{
+			fprintf( stderr, "Error: writing output file\n" );
+			return Z_ERRNO;
+		}
+	}
+
+	if( r != TINF_OK )
+	{
+		fprintf( stderr, "Error: tinf: %s (%d)\n", tinf_error_string( r ), r );
+		return -44;
+	}
+	return 0;
+}
+
+static int tinf_decompress_stream( const struct rtgzopts * o, struct rtgzworker * w, struct filegroup * fg, struct rtgzstats * st )
+{
+	tinf_stream_init( w->tinf );
+	tinf_stream_set_history( w->tinf, w->history, o->windowsize );
+	tinf_stream_set_dictionary( w->tinf, o->dict, o->dictlen );
+	return tinf_push_all( w, fg, st );
+}
+
+// Decode just -s/-n, starting from the last -x access point before it, if
+// there is an index. Without one this still works, from the start.
+static int tinf_decompress_range( const struct rtgzopts * o, struct rtgzworker * w, struct filegroup * fg, struct rtgzstats * st )
+{
+	struct tinf_access_point * pts = 0;
+	const struct tinf_access_point * ap = 0;
+	long n = 0, i;
+	int r;
+
+	if( o->indexfile && ( n = read_index( o->indexfile, &pts ) ) < 0 )
+	{
+		fprintf( stderr, "Error: can't read index %s\n", o->indexfile );
+		return -16;
+	}
+
+	// The last entry is the end of the stream, there is nothing to decode.
+	for( i = 0; i < n - 1; i++ )
+	{
+		if( pts[i].out_offset <= o->rangestart )
+			ap = &pts[i];
+	}
+
+	if( ap && ap->in_offset )
+	{
+		int bad = fg->map ? ap->in_offset > fg->maplen : fseeko( fg->fRead, ap->in_offset, SEEK_SET ) != 0;
+		if( bad )
+		{
+			fprintf( stderr, "Error: can't seek to offset %lu in the input\n", ap->in_offset );
+			free( pts );
+			return -16;
+		}
+		if( fg->map )
+			fg->mappos = ap->in_offset;
+	}
+
+	tinf_stream_init_at( w->tinf, ap, o->rangestart, o->rangelen );
+	tinf_stream_set_history( w->tinf, w->history, o->windowsize );
+	// Full flushes drop the history, so only the start sees the dictionary.
+	if( !ap || ap->out_offset == 0 )
+		tinf_stream_set_dictionary( w->tinf, o->dict, o->dictlen );
+	r = tinf_push_all( w, fg, st );
+	if( !r && o->verbose && ap )
+		fprintf( stderr, "Started at access point %ld of %ld (offset %lu, compressed %lu)\n", (long)( ap - pts ), n - 1, ap->out_offset, ap->in_offset );
+	free( pts );
+	return r;
+}
+
+// Histograms are by powers of two: lengths 3, 4-7, ... 128-255, 256-258
+// and distances 1, 2-3, ... 16384-32767, 32768.
+#define LENGTH_BUCKETS 8
+#define DIST_BUCKETS 16
+
+struct analysis
+{
+	uint64_t blocks[3]; // stored, fixed, dynamic
+	uint64_t literals;
+	uint64_t matches;
+	uint64_t matchbytes;
+	unsigned int maxoffs;
+	uint64_t lengths[LENGTH_BUCKETS];
+	uint64_t dists[DIST_BUCKETS];
+};
+
+static int ilog2( unsigned int v )
+{
+	int r = 0;
+	while( v >>= 1 ) r++;
+	return r;
+}
+
+static void analyze_block( struct analysis * a, int btype )
+{
+	if( btype < 3 ) a->blocks[btype]++;
+}
+
+static void analyze_literal( struct analysis * a )
+{
+	a->literals++;
+}
+
+static void analyze_match( struct analysis * a, int length, unsigned int offs )
+{
+	int lb = ilog2( length ) - 1;
+	a->matches++;
+	a->matchbytes += length;
+	if( offs > a->maxoffs ) a->maxoffs = offs;
+	a->lengths[lb < LENGTH_BUCKETS ? lb : LENGTH_BUCKETS - 1]++;
+	a->dists[ilog2( offs )]++;
+}
+
+static void print_histogram( FILE * f, const char * title, const uint64_t * counts, int buckets, int first, uint64_t total )
+{
+	int i;
+	fprintf( f, "%s:\n", title );
+	for( i = 0; i < buckets; i++ )
+	{
+		unsigned int lo = i ? 1u << ( i + first ) : first ? 3 : 1;
+		unsigned int hi = ( 2u << ( i + first ) ) - 1;
+		char range[32];
+		if( i == buckets - 1 ) hi = first ? 258 : 32768;
+		if( lo == hi ) snprintf( range, sizeof( range ), "%u", lo );
+		else snprintf( range, sizeof( range ), "%u-%u", lo, hi );
+		fprintf( f, "  %-12s %12llu  %5.1f%%\n", range, (unsigned long long)counts[i], total ? 100.0 * counts[i] / total : 0.0 );
+	}
+}
+
+// Decode the whole stream with the largest window, only to collect the
+// statistics, then report which window a device would need for it.
+static int analyze_stream( const struct rtgzopts * o, struct rtgzworker * w, struct filegroup * fg, struct rtgzstats * st )
+{
+	struct analysis a;
+	const uint8_t * in = 0;
+	size_t inpos = 0, inlen = 0;
+	int r = TINF_NEED_INPUT;
+	int bits;
+
+	memset( &a, 0, sizeof( a ) );
+	tinf_stream_init( w->tinf );
+	tinf_stream_set_history( w->tinf, w->history, STREAM_BUFFER_BITS );
+	tinf_stream_set_dictionary( w->tinf, o->dict, o->dictlen );
+	w->tinf->opaque = &a;
+
+	while( r == TINF_NEED_INPUT || r == TINF_NEED_OUTPUT )
+	{
+		unsigned int consumed, produced;
+
+		if( r == TINF_NEED_INPUT )
+		{
+			in = read_input( st, fg, w->in, fg->map ? MAP_RUN : IO_CHUNK, &inlen );
+			inpos = 0;
+			if( !in )
+			{
+				fprintf( stderr, "Error: reading input file\n" );
+				return Z_ERRNO;
+			}
+			if( inlen == 0 )
+				break;
+		}
+
+		r = tinf_stream_push( w->tinf, in + inpos, inlen - inpos, w->out, IO_CHUNK, &consumed, &produced );
+		inpos += consumed;
+		st->bytesout += produced;
+	}
+
+	if( r != TINF_OK )
+	{
+		fprintf( stderr, "Error: tinf: %s (%d)\n", r == TINF_STREAM_ERROR ? "match distance of 32768 can't be decoded by tinf" : tinf_error_string( r ), r );
+		return -44;
+	}
+
+	// tinf's ring has to be larger than the longest distance.
+	for( bits = 9; bits < 15 && a.maxoffs >= ( 1u << bits ); bits++ );
 
-struct filegroup
+	fprintf( fg->fWrite, "Compressed: %llu bytes\n", (unsigned long long)st->bytesin );
+	fprintf( fg->fWrite, "Decompressed: %llu bytes\n", (unsigned long long)st->bytesout );
+	fprintf( fg->fWrite, "Blocks: %llu (stored %llu, fixed %llu, dynamic %llu)\n",
+		(unsigned long long)( a.blocks[0] + a.blocks[1] + a.blocks[2] ), (unsigned long long)a.blocks[0],
+		(unsigned long long)a.blocks[1], (unsigned long long)a.blocks[2] );
+	fprintf( fg->fWrite, "Literals: %llu (%.2f%% of output)\n", (unsigned long long)a.literals,
+		st->bytesout ? 100.0 * a.literals / st->bytesout : 0.0 );
+	fprintf( fg->fWrite, "Matches: %llu covering %llu bytes (%.2f%% of output), %.2f literals per match\n",
+		(unsigned long long)a.matches, (unsigned long long)a.matchbytes,
+		st->bytesout ? 100.0 * a.matchbytes / st->bytesout : 0.0, a.matches ? (double)a.literals / a.matches : 0.0 );
+	fprintf( fg->fWrite, "Longest match distance: %u\n", a.maxoffs );
+	fprintf( fg->fWrite, "Minimum window bits: %d (STREAM_BUFFER_BITS / -w)\n", bits );
+	print_histogram( fg->fWrite, "Match lengths", a.lengths, LENGTH_BUCKETS, 1, a.matches );
+	print_histogram( fg->fWrite, "Match distances", a.dists, DIST_BUCKETS, 0, a.matches );
+	return 0;
+}
+
+// Decode with tinf_uncompress, with the whole stream in memory. The output
+// buffer grows until it fits. This has the whole history, so -w is not
+// checked.
+static int tinf_decompress_buffer( const struct rtgzopts * o, struct filegroup * fg, struct rtgzstats * st )
 {
-	FILE * fRead;
-	FILE * fWrite;
+	size_t inlen = 0, incap = IO_CHUNK;
+	uint8_t * inbuf = fg->map ? 0 : malloc( incap );
+	const uint8_t * in = fg->map ? fg->map : inbuf;
+	uint8_t * out = 0;
+	size_t outcap;
+	unsigned int outlen = 0;
+	int r = TINF_DATA_ERROR;
+	int ret = 0;
+
+	if( fg->map )
+	{
+		inlen = fg->maplen;
+		st->bytesin = inlen;
+	}
+
+	while( inbuf )
+	{
+		size_t len;
+		uint8_t * grown;
+		if( !read_input( st, fg, inbuf + inlen, incap - inlen, &len ) )
+		{
+			fprintf( stderr, "Error: reading input file\n" );
+			free( inbuf );
+			return Z_ERRNO;
+		}
+		inlen += len;
+		// Stop growing once the input can't be decoded in one call anyway.
+		if( inlen < incap || inlen > 0xffffffffUL )
+			break;
+		incap *= 2;
+		grown = realloc( inbuf, incap );
+		if( !grown )
+			free( inbuf );
+		in = inbuf = grown;
+	}
+
+	if( in && inlen > 0xffffffffUL )
+	{
+		fprintf( stderr, "Error: input too large for buffer mode\n" );
+		free( inbuf );
+		return -9;
+	}
+
+	// The dictionary goes right in front of the output, as its history.
+	for( outcap = inlen * 4 > IO_CHUNK ? inlen * 4 : IO_CHUNK; in; outcap *= 2 )
+	{
+		uint8_t * grown;
+		if( outcap > 0xffffffffUL )
+			break;
+		grown = realloc( out, o->dictlen + outcap );
+		if( !grown )
+		{
+			free( out );
+			out = 0;
+			break;
+		}
+		out = grown;
+		if( o->dictlen )
+			memcpy( out, o->dict, o->dictlen );
+		outlen = outcap;
+		r = tinf_uncompress_history( out + o->dictlen, &outlen, in, inlen, o->dictlen );
+		if( r != TINF_BUF_ERROR )
+			break;
+	}
+
+	if( in && outcap > 0xffffffffUL )
+	{
+		fprintf( stderr, "Error: output too large for buffer mode\n" );
+		ret = -9;
+	}
+	else if( !in || !out )
+	{
+		fprintf( stderr, "Error: out of memory\n" );
+		ret = -9;
+	}
+	else if( r != TINF_OK )
+	{
+		fprintf( stderr, "Error: tinf: %s (%d)\n", tinf_error_string( r ), r );
+		ret = -44;
+	}
+	else
+	{
+		if( write_output( st, fg, out + o->dictlen, outlen ) )
+		{
+			fprintf( stderr, "Error: writing output file\n" );
+			ret = Z_ERRNO;
+		}
+	}
+
+	free( inbuf );
+	free( out );
+	return ret;
+}
+
+static double mb_per_s( uint64_t bytes, double seconds )
+{
+	return seconds > 0 ? bytes / seconds / 1e6 : 0.0;
+}
+
+// Print --stats for one file to stderr. The report is put together first,
+// so lines from batch workers don't interleave.
+static void print_stats( const struct rtgzopts * o, const char * infile, const struct rtgzstats * st )
+{
+	static const char * opnames[] = { "", "compress", "decompress", "analyze" };
+	static const char * phases[] = { "read", "codec", "write", "total" };
+	uint64_t plain = o->operation == 1 ? st->bytesin : st->bytesout;
+	uint64_t phasebytes[4] = { st->bytesin, plain, st->bytesout, plain };
+	double wall[4], cpu[4];
+	struct rusage ru;
+	char * report = 0;
+	size_t reportlen;
+	FILE * f;
+	int i;
+
+	wall[0] = st->readwall;
+	cpu[0] = st->readcpu;
+	wall[2] = st->writewall;
+	cpu[2] = st->writecpu;
+	wall[3] = st->wall;
+	cpu[3] = st->cpu;
+	wall[1] = wall[3] - wall[0] - wall[2];
+	cpu[1] = cpu[3] - cpu[0] - cpu[2];
+	getrusage( RUSAGE_SELF, &ru );
+
+	f = open_memstream( &report, &reportlen );
+	if( !f )
+		return;
+
+	if( o->stats == 2 )
+	{
+		const char * c;
+		fprintf( f, "{\"file\": \"" );
+		for( c = infile ? infile : "-"; *c; c++ )
+		{
+			if( *c == '"' || *c == '\\' ) fprintf( f, "\\%c", *c );
+			else if( (unsigned char)*c < 0x20 ) fprintf( f, "\\u%04x", *c );
+			else fputc( *c, f );
+		}
+		fprintf( f, "\", \"operation\": \"%s\", \"bytes_in\": %llu, \"bytes_out\": %llu, \"reads\": %llu, \"writes\": %llu, \"chunks\": %llu",
+			opnames[o->operation], (unsigned long long)st->bytesin, (unsigned long long)st->bytesout,
+			(unsigned long long)st->reads, (unsigned long long)st->writes, (unsigned long long)st->chunks );
+		for( i = 0; i < 4; i++ )
+		{
+			fprintf( f, ", \"%s\": {\"wall_s\": %.6f, \"cpu_s\": %.6f, \"mb_per_s\": %.2f}",
+				phases[i], wall[i], cpu[i], mb_per_s( phasebytes[i], wall[i] ) );
+		}
+		fprintf( f, ", \"mapped_input\": %s, \"peak_rss_kib\": %ld", st->mapped ? "true" : "false", ru.ru_maxrss );
+		if( st->zchecked )
+			fprintf( f, ", \"zlib_total_in\": %llu, \"zlib_total_out\": %llu}\n",
+				(unsigned long long)st->ztotalin, (unsigned long long)st->ztotalout );
+		else
+			fprintf( f, ", \"zlib_total_in\": null, \"zlib_total_out\": null}\n" );
+	}
+	else
+	{
+		fprintf( f, "%s (%s):\n", infile ? infile : "stdin", opnames[o->operation] );
+		if( st->mapped )
+			fprintf( f, "  in:     %llu bytes, mapped (reading is part of codec time)\n", (unsigned long long)st->bytesin );
+		else
+			fprintf( f, "  in:     %llu bytes in %llu reads\n", (unsigned long long)st->bytesin, (unsigned long long)st->reads );
+		fprintf( f, "  out:    %llu bytes in %llu writes\n", (unsigned long long)st->bytesout, (unsigned long long)st->writes );
+		if( st->chunks )
+			fprintf( f, "  chunks: %llu\n", (unsigned long long)st->chunks );
+		fprintf( f, "  %-6s %10s %10s %10s\n", "phase", "wall s", "cpu s", "MB/s" );
+		for( i = 0; i < 4; i++ )
+			fprintf( f, "  %-6s %10.3f %10.3f %10.1f\n", phases[i], wall[i], cpu[i], mb_per_s( phasebytes[i], wall[i] ) );
+		fprintf( f, "  peak RSS: %ld KiB\n", ru.ru_maxrss );
+		if( st->zchecked )
+			fprintf( f, "  zlib total_in / total_out: %llu / %llu\n", (unsigned long long)st->ztotalin, (unsigned long long)st->ztotalout );
+	}
+
+	fclose( f );
+	fputs( report, stderr );
+	free( report );
+}
+
+// Compress or decompress one file, NULL names meaning stdin / stdout.
+static int process_file( const struct rtgzopts * o, struct rtgzworker * w, const char * infile, const char * outfile, struct rtgzstats * st )
+{
+	struct filegroup fg;
+	void * writebuf = 0;
+	double wall = wall_time(), cpu = cpu_time(), closewall, closecpu;
+	int ret;
+
+	memset( st, 0, sizeof( *st ) );
+
+	fg.fRead = infile ? fopen( infile, "rb" ) : stdin;
+	if( !fg.fRead )
+	{
+		fprintf( stderr, "Error: can't open in file %s\n", infile );
+		return -7;
+	}
+
+	fg.fWrite = outfile ? fopen( outfile, "wb" ) : stdout;
+	if( !fg.fWrite )
+	{
+		fprintf( stderr, "Error: can't open out file %s\n", outfile );
+		if( infile ) fclose( fg.fRead );
+		return -8;
+	}
+
+	map_input( &fg );
+	st->mapped = fg.map != 0;
+
+	// Have stdio hand the kernel large, page aligned writes.
+	if( posix_memalign( &writebuf, 4096, IO_CHUNK ) == 0 )
+		setvbuf( fg.fWrite, writebuf, _IOFBF, IO_CHUNK );
+
+	if( o->operation == 1 && o->optimal )
+		ret = compress_optimal( o, &fg, st );
+	else if( o->operation == 1 && o->indexfile )
+		ret = compress_indexed( o, w, &fg, st );
+	else if( o->operation == 1 && o->engine == ENGINE_TDEFL )
+		ret = compress_tdefl( o, w, &fg, st );
+	else if( o->operation == 1 && o->threads > 0 )
+		ret = compress_parallel( &fg, o->compresslevel, o->windowsize, o->threads, o->chunksize, o->dict, o->dictlen, st );
+	else if( o->operation == 1 )
+		ret = compress_zlib( o, w, &fg, st );
+	else if( o->operation == 3 )
+		ret = analyze_stream( o, w, &fg, st );
+	else if( o->ranged )
+		ret = tinf_decompress_range( o, w, &fg, st );
+	else if( o->engine == ENGINE_TINF )
+		ret = tinf_decompress_stream( o, w, &fg, st );
+	else if( o->engine == ENGINE_TINFBUF )
+		ret = tinf_decompress_buffer( o, &fg, st );
+	else
+		ret = decompress_zlib( o, w, &fg, st );
+
+	// Flushing what stdio still holds is part of writing.
+	closewall = wall_time();
+	closecpu = cpu_time();
+	if( fclose( fg.fWrite ) && !ret )
+	{
+		fprintf( stderr, "Error: writing output file\n" );
+		ret = Z_ERRNO;
+	}
+	st->writewall += wall_time() - closewall;
+	st->writecpu += cpu_time() - closecpu;
+	if( fg.map ) munmap( (void*)fg.map, fg.maplen );
+	if( infile ) fclose( fg.fRead );
+	free( writebuf );
+
+	st->wall = wall_time() - wall;
+	st->cpu = cpu_time() - cpu + st->workercpu;
+
+	// zlib's own count has to agree with ours. Decoders may stop before
+	// trailing input, so only the output has to match exactly there.
+	if( ret == 0 && st->zchecked && ( st->ztotalout != st->bytesout ||
+		( o->operation == 1 ? st->ztotalin != st->bytesin : st->ztotalin > st->bytesin ) ) )
+	{
+		fprintf( stderr, "Error: zlib counted %llu -> %llu bytes, rtgz %llu -> %llu\n",
+			(unsigned long long)st->ztotalin, (unsigned long long)st->ztotalout,
+			(unsigned long long)st->bytesin, (unsigned long long)st->bytesout );
+		ret = -15;
+	}
+
+	if( ret == 0 && o->verbose && o->operation != 3 )
+	{
+		if( o->operation == 1 )
+		{
+			fprintf( stderr, "Compression: %llu / %llu (%.2f%%) (w_bits = %d)", (unsigned long long)st->bytesin, (unsigned long long)st->bytesout,
+				st->bytesin ? 100.0 * st->bytesout / st->bytesin : 0.0, o->windowsize );
+			if( o->threads ) fprintf( stderr, " (%d threads)", o->threads );
+			if( o->optimal ) fprintf( stderr, " (optimal)" );
+			if( o->engine == ENGINE_TDEFL ) fprintf( stderr, " (tdefl)" );
+			if( o->indexfile ) fprintf( stderr, " (access point every %zu KiB)", o->chunksize / 1024 );
+		}
+		else
+		{
+			fprintf( stderr, "Decompression: %llu -> %llu (Was %.2f%%) (w_bits: %d)", (unsigned long long)st->bytesin, (unsigned long long)st->bytesout,
+				st->bytesout ? 100.0 * st->bytesin / st->bytesout : 0.0, o->windowsize );
+			if( o->ranged ) fprintf( stderr, " (tinf range from %llu)", (unsigned long long)o->rangestart );
+			else if( o->engine != ENGINE_ZLIB ) fprintf( stderr, " (tinf %s mode)", o->engine == ENGINE_TINF ? "stream" : "buffer" );
+		}
+		fprintf( stderr, "\n" );
+	}
+	if( ret == 0 && o->stats )
+		print_stats( o, infile, st );
+	return ret;
+}
+
+struct batch
+{
+	const struct rtgzopts * opts;
+	char ** files;
+	int count;
+	const char * outdir;
+	atomic_int next;
+	atomic_int failed;
 };
 
-static int producefile( void * v, unsigned char c )
+// Compressed files get .rz appended, decompressing takes it off again (or
+// appends .out if it isn't there). With an output directory, only the
+// base name of the input is kept.
+static char * batch_output_name( const struct batch * b, const char * infile )
+{
+	const char * base = infile;
+	size_t len;
+	char * name;
+
+	if( b->outdir )
+	{
+		const char * slash = strrchr( infile, '/' );
+		if( slash ) base = slash + 1;
+	}
+
+	len = strlen( base );
+	name = malloc( ( b->outdir ? strlen( b->outdir ) + 1 : 0 ) + len + 5 );
+	if( !name ) return 0;
+
+	name[0] = 0;
+	if( b->outdir )
+	{
+		strcat( name, b->outdir );
+		strcat( name, "/" );
+	}
+
+	if( b->opts->operation == 1 )
+	{
+		strcat( name, base );
+		strcat( name, ".rz" );
+	}
+	else if( len > 3 && strcmp( base + len - 3, ".rz" ) == 0 )
+	{
+		strncat( name, base, len - 3 );
+	}
+	else
+	{
+		strcat( name, base );
+		strcat( name, ".out" );
+	}
+	return name;
+}
+
+// Each worker takes the next file off the shared list until none are left,
+// so a few big files don't hold up the rest.
+static void * batch_worker( void * v )
 {
-	struct filegroup * dg = (struct filegroup*)v;
-	putc( c, dg->fWrite );
+	struct batch * b = (struct batch*)v;
+	struct rtgzworker w;
+
+	if( worker_init( &w ) )
+	{
+		atomic_fetch_add( &b->failed, 1 );
+		worker_free( &w );
+		return 0;
+	}
+
+	for( ;; )
+	{
+		int i = atomic_fetch_add( &b->next, 1 );
+		struct rtgzstats st;
+		char * outfile;
+		int ret;
+
+		if( i >= b->count )
+			break;
+
+		outfile = batch_output_name( b, b->files[i] );
+		ret = outfile ? process_file( b->opts, &w, b->files[i], outfile, &st ) : -9;
+
+		if( ret )
+		{
+			printf( "%s: failed (%d)\n", b->files[i], ret );
+			atomic_fetch_add( &b->failed, 1 );
+		}
+		else
+		{
+			printf( "%s -> %s: %llu -> %llu (%.2f%%)\n", b->files[i], outfile,
+				(unsigned long long)st.bytesin, (unsigned long long)st.bytesout,
+				st.bytesin ? 100.0 * st.bytesout / st.bytesin : 0.0 );
+		}
+		free( outfile );
+	}
+
+	worker_free( &w );
 	return 0;
 }
 
-static int feedfile( void * v )
+static int run_batch( const struct rtgzopts * o, char ** files, int count, const char * outdir, int jobs )
 {
-	struct filegroup * dg = (struct filegroup*)v;
-	uint8_t ret = 0;
-	if( fread( &ret, 1, 1, dg->fRead ) == 1 )
+	struct batch b;
+	pthread_t * threads;
+	int i;
+
+	b.opts = o;
+	b.files = files;
+	b.count = count;
+	b.outdir = outdir;
+	atomic_init( &b.next, 0 );
+	atomic_init( &b.failed, 0 );
+
+	if( jobs > count ) jobs = count;
+	threads = malloc( sizeof( pthread_t ) * ( jobs ? jobs : 1 ) );
+	if( !threads )
 	{
-		return ret;
+		fprintf( stderr, "Error: out of memory\n" );
+		return -9;
 	}
-	else
+
+	for( i = 0; i < jobs; i++ )
+	{
+		if( pthread_create( &threads[i], 0, batch_worker, &b ) )
+		{
+			fprintf( stderr, "Error: can't start worker thread\n" );
+			jobs = i;
+			atomic_fetch_add( &b.failed, 1 );
+			break;
+		}
+	}
+
+	for( i = 0; i < jobs; i++ )
+	{
+		pthread_join( threads[i], 0 );
+	}
+	free( threads );
+
+	printf( "%d files, %d failed\n", count, atomic_load( &b.failed ) );
+	return atomic_load( &b.failed ) ? -1 : 0;
+}
+
+// Append the non-empty lines of `f` to the file list.
+static int read_manifest( FILE * f, char *** files, int * count )
+{
+	char line[4096];
+
+	while( fgets( line, sizeof( line ), f ) )
+	{
+		size_t len = strlen( line );
+		char ** grown;
+
+		while( len && ( line[len-1] == '\n' || line[len-1] == '\r' ) )
+			line[--len] = 0;
+		if( !len )
+			continue;
+
+		grown = realloc( *files, sizeof( char * ) * ( *count + 1 ) );
+		if( !grown || !( grown[*count] = strdup( line ) ) )
+		{
+			fprintf( stderr, "Error: out of memory\n" );
+			return -9;
+		}
+		*files = grown;
+		(*count)++;
+	}
+	return 0;
+}
+
+// Keep the last 32 KiB of the file, no window can see further back.
+static int load_dictionary( const char * path, struct rtgzopts * o )
+{
+	static uint8_t dict[1<<15];
+	FILE * f = fopen( path, "rb" );
+	size_t len = 0, n;
+
+	if( !f )
+		return -1;
+	// Read through it with the buffer as a ring, then straighten it out.
+	while( ( n = fread( dict + len % sizeof( dict ), 1, sizeof( dict ) - len % sizeof( dict ), f ) ) > 0 )
+		len += n;
+	if( ferror( f ) )
+	{
+		fclose( f );
 		return -1;
+	}
+	fclose( f );
+	if( len > sizeof( dict ) )
+	{
+		uint8_t * tmp = malloc( sizeof( dict ) );
+		size_t split = len % sizeof( dict );
+		if( !tmp )
+			return -1;
+		memcpy( tmp, dict + split, sizeof( dict ) - split );
+		memcpy( tmp + sizeof( dict ) - split, dict, split );
+		memcpy( dict, tmp, sizeof( dict ) );
+		free( tmp );
+		len = sizeof( dict );
+	}
+	o->dict = dict;
+	o->dictlen = len;
+	return 0;
 }
 
 int main( int argc, char ** argv )
 {
 	char * infile = 0;
 	char * outfile = 0;
-	int operation = 0;
-	int windowsize = 9;
+	char * outdir = 0;
+	char * dictfile = 0;
+	int manifest = 0;
+	int jobs = sysconf( _SC_NPROCESSORS_ONLN );
+	int chunkkb = 1024;
+	struct rtgzopts o = { 0 };
+	o.windowsize = 9;
+	o.compresslevel = 6;
+	o.engine = ENGINE_ZLIB;
+	o.rangelen = UINT64_MAX;
 	opterr = 0;
-	int compresslevel = 6;
-	int verbose = 0;
 	int c;
-	while( ( c = getopt (argc, argv, "o:i:cdhw:l:v") ) != -1 )
+	static const struct option longopts[] = {
+		{ "stats", optional_argument, 0, 'S' },
+		{ 0, 0, 0, 0 }
+	};
+	while( ( c = getopt_long( argc, argv, "o:i:cdahw:l:ve:p:b:mt:j:Ox:s:n:D:", longopts, 0 ) ) != -1 )
 	{
 		switch( c )
 		{
+		case 'S':
+			if( !optarg || strcmp( optarg, "human" ) == 0 ) o.stats = 1;
+			else if( strcmp( optarg, "json" ) == 0 ) o.stats = 2;
+			else
+			{
+				fprintf( stderr, "Error: --stats takes human or json\n" );
+				return -5;
+			}
+			break;
 		case 'i':
 			infile = optarg;
 			break;
@@ -83,200 +1678,200 @@ int main( int argc, char ** argv )
 			outfile = optarg;
 			break;
 		case 'w':
-			windowsize = atoi( optarg );
+			o.windowsize = atoi( optarg );
 			break;
 		case 'l':
-			compresslevel = atoi( optarg );
+			o.compresslevel = atoi( optarg );
 			break;
 		case 'v':
-			verbose = 1;
+			o.verbose = 1;
+			break;
+		case 'p':
+			o.threads = atoi( optarg );
+			break;
+		case 'b':
+			chunkkb = atoi( optarg );
+			break;
+		case 'm':
+			manifest = 1;
+			break;
+		case 't':
+			outdir = optarg;
+			break;
+		case 'O':
+			o.optimal = 1;
+			break;
+		case 'x':
+			o.indexfile = optarg;
+			break;
+		case 'D':
+			dictfile = optarg;
+			break;
+		case 's':
+			o.rangestart = strtoull( optarg, 0, 0 );
+			o.ranged = 1;
+			break;
+		case 'n':
+			o.rangelen = strtoull( optarg, 0, 0 );
+			o.ranged = 1;
+			break;
+		case 'j':
+			jobs = atoi( optarg );
+			break;
+		case 'e':
+			if( strcmp( optarg, "zlib" ) == 0 ) o.engine = ENGINE_ZLIB;
+			else if( strcmp( optarg, "tinf" ) == 0 ) o.engine = ENGINE_TINF;
+			else if( strcmp( optarg, "tinfbuf" ) == 0 ) o.engine = ENGINE_TINFBUF;
+			else if( strcmp( optarg, "tdefl" ) == 0 ) o.engine = ENGINE_TDEFL;
+			else
+			{
+				fprintf( stderr, "Error: Unknown engine %s\n", optarg );
+				return -5;
+			}
 			break;
 		case 'c':
 		case 'd':
-			if( operation > 0 )
+		case 'a':
+			if( o.operation > 0 )
 			{
-				fprintf( stderr, "Error: can't compress and decompress\n" );
+				fprintf( stderr, "Error: only one of -c, -d and -a can be used\n" );
 				return -5;
 			}
-			operation = c - 'c' + 1;
+			o.operation = c == 'a' ? 3 : c - 'c' + 1;
 			break;
 		default:
-			fprintf( stderr, "Error: Usage: rtgz [-o out file] [-i infile] -c/-d [-w windowsize bits (9-15)] [-l compress level] [-v]\n" );
+			fprintf( stderr, "Error: Usage: rtgz [-o out file] [-i infile] -c/-d/-a [-w windowsize bits (9-15)] [-l compress level] [-e zlib/tinf/tinfbuf/tdefl] [-p threads] [-b chunk KiB] [-O] [-x index] [-s offset] [-n length] [-D dictionary] [-v] [--stats[=human|json]]\n" );
+			fprintf( stderr, "       rtgz -c/-d [options] [-m] [-t out dir] [-j jobs] files...\n" );
 			fprintf( stderr, "  compresses / decompreses raw deflate data (gzip/zlib) without a header and with limited window size\n" );
+			fprintf( stderr, "  -p compresses -b sized chunks (default 1024 KiB) on that many threads, each primed with the previous window\n" );
+			fprintf( stderr, "  -a decodes the stream and writes statistics, including the smallest -w that decodes it\n" );
+			fprintf( stderr, "  --stats reports sizes, read/codec/write times and throughput, peak RSS and zlib's byte counts to stderr\n" );
+			fprintf( stderr, "  -x with -c full flushes every -b KiB and writes an index of those access points,\n" );
+			fprintf( stderr, "     with -d it lets tinf decode -n bytes at -s from the nearest access point instead of the start\n" );
+			fprintf( stderr, "  -D primes both sides with a preset dictionary file (its last 32 KiB), for small messages\n" );
+			fprintf( stderr, "  -O compresses with a slow optimal parser (iterated cost model, block splitting) for the smallest output\n" );
+			fprintf( stderr, "  -e picks the decoder: zlib (default), tinf in stream mode (rejects streams needing more than -w) or tinf in buffer mode\n" );
+			fprintf( stderr, "     or, with -c, tdefl: the small bounded memory encoder from tdefl_sf.h instead of zlib\n" );
+			fprintf( stderr, "  with files listed (or -m to read a list from stdin), processes each on -j workers (default: all cores),\n" );
+			fprintf( stderr, "  writing file.rz / removing .rz next to the input or in -t, and prints a line per file\n" );
 			return -5;
 		}
 	}
 
-	if( operation == 0 )
+	if( o.operation == 0 )
 	{
-		fprintf( stderr, "Error: Need to have either -c or -d flag for compress/decompress\n" );
+		fprintf( stderr, "Error: Need to have a -c, -d or -a flag for compress/decompress/analyze\n" );
 		return -5;
 	}
 
-	if( windowsize > 15 || windowsize < 9 )
+	if( o.windowsize > 15 || o.windowsize < 9 )
 	{
-		fprintf( stderr, "Error: Invalid window size %d\n", windowsize );
+		fprintf( stderr, "Error: Invalid window size %d\n", o.windowsize );
 		return -6;
 	}
 
-	struct filegroup fg;
-	fg.fRead = infile ? fopen( infile, "rb" ) : stdin;
-	fg.fWrite = outfile ? fopen( outfile, "wb" ) : stdout;
-	unsigned char in[CHUNK];
-	unsigned char out[CHUNK];
-
-	if( !fg.fRead )
+	if( o.threads < 0 || o.threads > 256 || chunkkb < 1 )
 	{
-		fprintf( stderr, "Error: can't open in file %s\n", infile );
-		return -7;
+		fprintf( stderr, "Error: Invalid thread count or chunk size\n" );
+		return -6;
 	}
+	o.chunksize = (size_t)chunkkb * 1024;
 
-	if( !fg.fWrite )
+	if( o.indexfile && o.operation == 1 && ( o.threads || o.optimal || o.engine != ENGINE_ZLIB ) )
 	{
-		fprintf( stderr, "Error: can't open out file %s\n", outfile );
-		return -8;
+		fprintf( stderr, "Error: -x compresses with zlib, without -p or -O\n" );
+		return -5;
 	}
 
-	int bytesin = 0;
-	int bytesout = 0;
-
-	if( operation == 1 )
+	if( ( o.ranged || o.indexfile ) && o.operation == 3 )
 	{
-		int ret, flush;
-		unsigned have;
-		z_stream stream = { 0 };
-
-		// Compress( deflate )
-		ret = deflateInit2( &stream, compresslevel, Z_DEFLATED, -windowsize, MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY );
-		if (ret != Z_OK)
-		{
-			fprintf( stderr, "Error: deflateInit2() = %d\n", ret );
-			return ret;
-		}
-
-		do
-		{
-			stream.avail_in = fread( in, 1, CHUNK, fg.fRead );
-			if ( ferror( fg.fRead ) )
-			{
-				fprintf( stderr, "Error: read failure on in file\n" );
-				(void)deflateEnd( &stream );
-				return -13;
-			}
-			bytesin += stream.avail_in;
-			flush = feof( fg.fRead ) ? Z_FINISH : Z_NO_FLUSH;
-			stream.next_in = in;
-
-			/* run deflate() on input until output buffer not full, finish
-			compression if all of source has been read in */
-			do {
-				stream.avail_out = CHUNK;
-				stream.next_out = out;
-				ret = deflate(&stream, flush);    /* no bad return value */
-				if( ret == Z_STREAM_ERROR )
-				{
-					fprintf( stderr, "Error: Error compressing block\n" );
-					return -12;
-				}
-
-				have = CHUNK - stream.avail_out;
-				bytesout += have;
-				if ( fwrite( out, 1, have, fg.fWrite ) != have || ferror( fg.fWrite ) )
-				{
-					fprintf( stderr, "Error: Error writing compressed data\n" );
-					return -12;
-				}
-			} while (stream.avail_out == 0);
-			if( stream.avail_in != 0 )
-			{
-				fprintf( stderr, "Error: Stream ended prematurely\n" );
-			}
-		} while (flush != Z_FINISH);
+		fprintf( stderr, "Error: -x, -s and -n don't work with -a\n" );
+		return -5;
+	}
+	if( o.operation == 2 && o.indexfile )
+		o.ranged = 1;
+	if( o.ranged && o.operation != 2 )
+	{
+		fprintf( stderr, "Error: -s and -n only work when decompressing\n" );
+		return -5;
+	}
 
-		if( ret != Z_STREAM_END )
+	if( dictfile )
+	{
+		if( o.optimal || o.engine == ENGINE_TDEFL )
 		{
-			fprintf( stderr, "stream not ended\n" );
-			return -6;
+			fprintf( stderr, "Error: -D doesn't work with -O or tdefl\n" );
+			return -5;
 		}
-		(void)deflateEnd(&stream);
-		if( verbose )
+		if( load_dictionary( dictfile, &o ) )
 		{
-			fprintf( stderr, "Compression: %d / %d (%.2f%%) (w_bits = %d)\n", bytesin, bytesout, 100.0 * bytesout / bytesin, windowsize );
+			fprintf( stderr, "Error: can't read dictionary %s\n", dictfile );
+			return -7;
 		}
 	}
-	else if( operation == 2 )
+
+	if( o.optimal && ( o.operation != 1 || o.threads ) )
+	{
+		fprintf( stderr, "Error: -O only works when compressing, without -p\n" );
+		return -5;
+	}
+
+	if( o.operation == 1 && o.engine != ENGINE_ZLIB && o.engine != ENGINE_TDEFL )
 	{
-		z_stream strm = { 0 };
+		fprintf( stderr, "Error: tinf can only decompress\n" );
+		return -5;
+	}
 
-		int ret = inflateInit2( &strm, -windowsize ); //const char *version, int stream_size);
+	if( o.engine == ENGINE_TDEFL && ( o.operation != 1 || o.threads || o.optimal ) )
+	{
+		fprintf( stderr, "Error: tdefl only compresses, without -p or -O\n" );
+		return -5;
+	}
 
-		int have = 0;
+	if( manifest || optind < argc )
+	{
+		char ** files = 0;
+		int count = 0;
+		int i;
 
-		if (ret != Z_OK)
+		if( o.operation == 3 || o.indexfile || o.ranged )
 		{
-			fprintf( stderr, "Error: inflateInit() fault %d\n", ret );
-			return ret;
+			fprintf( stderr, "Error: -a, -x, -s and -n work on one file\n" );
+			return -5;
 		}
-
-		do {
-			strm.avail_in = fread(in, 1, CHUNK, fg.fRead);
-			if (ferror(fg.fRead)) {
-				(void)inflateEnd(&strm);
-				fprintf( stderr, "Error: reading from file %s\n", infile );
-				return Z_ERRNO;
-			}
-
-			bytesin += strm.avail_in;
-			if (strm.avail_in == 0)
-				break;
-			strm.next_in = in;
-
-			/* run inflate() on input until output buffer not full */
-			do {
-				strm.avail_out = CHUNK;
-				strm.next_out = out;
-				ret = inflate(&strm, Z_NO_FLUSH);
-				switch (ret) {
-					case Z_NEED_DICT:
-						ret = Z_DATA_ERROR;     /* and fall through */
-					case Z_DATA_ERROR:
-					case Z_MEM_ERROR:
-						(void)inflateEnd(&strm);
-						fprintf( stderr, "Error: zlib error: %d\n", ret );
-						return ret;
-					default:
-						break;
-				}
-				have = CHUNK - strm.avail_out;
-				bytesout += have;
-				if (fwrite(out, 1, have, fg.fWrite) != have || ferror(fg.fWrite)) {
-					(void)inflateEnd(&strm);
-					fprintf( stderr, "Error: error writing to file %s\n", outfile );
-					return Z_ERRNO;
-				}
-			} while (strm.avail_out == 0);
-
-			/* done when inflate() says it's done */
-		} while (ret != Z_STREAM_END);
-
-		/* clean up and return */
-		(void)inflateEnd(&strm);
-		if( ret != Z_STREAM_END )
+		if( infile || outfile )
 		{
-			fprintf( stderr, "Error: inflateEnd error\n" );
-			return -44;
+			fprintf( stderr, "Error: -i/-o can't be used with a list of files\n" );
+			return -5;
 		}
-		if( verbose )
+		if( jobs < 1 ) jobs = 1;
+
+		for( i = optind; i < argc; i++ )
 		{
-			fprintf( stderr, "Decompression: %d -> %d (Was %.2f%%) (w_bits: %d)\n", bytesin, bytesout, 100.0 * bytesin / bytesout, windowsize );
+			char ** grown = realloc( files, sizeof( char * ) * ( count + 1 ) );
+			if( !grown )
+			{
+				fprintf( stderr, "Error: out of memory\n" );
+				return -9;
+			}
+			files = grown;
+			files[count++] = strdup( argv[i] );
 		}
-	}
+		if( manifest && read_manifest( stdin, &files, &count ) )
+			return -9;
 
-	
+		int ret = run_batch( &o, files, count, outdir, jobs );
+		for( i = 0; i < count; i++ )
+			free( files[i] );
+		free( files );
+		return ret;
+	}
 
-	fclose( fg.fWrite );
-	fclose( fg.fRead );
-	return 0;
+	struct rtgzworker w;
+	struct rtgzstats st;
+	int ret = worker_init( &w );
+	if( !ret )
+		ret = process_file( &o, &w, infile, outfile, &st );
+	worker_free( &w );
+	return ret;
 }
-
-
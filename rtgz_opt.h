@@ -0,0 +1,904 @@
+// rtgz_opt.h - slow, optimal parsing raw deflate compressor for rtgz -O.
+//
+// Works like zopfli: the matches at every position are found once, then
+// each block is parsed as the cheapest path through a cost model, which is
+// re-estimated from the previous parse a number of times. The input is
+// split into blocks where new Huffman trees pay for themselves, and every
+// block is sent as whichever of stored, fixed or dynamic is smallest.
+//
+// Distances are kept below 1 << window_bits, so the output decodes with a
+// tinf ring (STREAM_BUFFER_BITS) of that size. It is meant for offline use:
+// it is around a hundred times slower than zlib -9.
+
+#ifndef _RTGZ_OPT_H
+#define _RTGZ_OPT_H
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// How many times each block is re-parsed with the costs of the last parse.
+#ifndef RTGZ_OPT_ITERATIONS
+#define RTGZ_OPT_ITERATIONS 15
+#endif
+
+// Longest hash chain walked looking for matches.
+#ifndef RTGZ_OPT_CHAIN
+#define RTGZ_OPT_CHAIN 1024
+#endif
+
+// Bytes whose matches are cached and parsed together, and the most blocks
+// one of them is split into.
+#define RTGZ_OPT_MASTER ( 1 << 20 )
+#define RTGZ_OPT_MAXBLOCKS 15
+
+// Smallest number of symbols on either side of a block split.
+#define RTGZ_OPT_MINSPLIT 256
+
+#define RTGZ_OPT_HASH_BITS 15
+#define RTGZ_OPT_MAX_MATCH 258
+
+static const uint16_t opt_len_base[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t opt_len_extra[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t opt_dist_base[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const uint8_t opt_dist_extra[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+static const uint8_t opt_clen_order[19] = {
+	16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+// A literal (dist == 0, litlen is the byte) or a match.
+struct optsym
+{
+	uint16_t litlen;
+	uint16_t dist;
+};
+
+struct optcost
+{
+	float lit[256];
+	float len[RTGZ_OPT_MAX_MATCH + 1]; // Including extra bits
+	float * dist; // Per distance, including extra bits
+};
+
+// Huffman trees for one block, and what they cost to send.
+struct opttrees
+{
+	uint8_t litlen[288];
+	uint8_t dist[30];
+	uint16_t litcode[288];
+	uint16_t distcode[30];
+	int hlit, hdist, hclen;
+	uint8_t clen[19];
+	uint16_t clcode[19];
+	uint8_t rle[286 + 30];
+	uint8_t rleextra[286 + 30];
+	int rlecount;
+};
+
+struct optstate
+{
+	const uint8_t * data;
+	size_t len;
+	unsigned int maxdist;
+	unsigned int ringmask;
+
+	int32_t * head;
+	int32_t * prev;
+
+	// Matches of the current master block, as (length, distance) pairs
+	// of increasing length and distance for each position.
+	size_t mbase;
+	uint32_t * mstart;
+	uint16_t * mlist;
+	size_t mcount, mcap;
+	uint16_t * same; // Run of equal bytes starting at each position
+
+	double * cost;
+	uint16_t * choicelen;
+	uint16_t * choicedist;
+	struct optsym * syms;
+	struct optsym * best;
+	struct optsym * fixed;
+	size_t * sympos;
+
+	uint8_t lencode[RTGZ_OPT_MAX_MATCH + 1];
+	struct optcost costs;
+
+	uint8_t * out;
+	size_t outlen, outcap;
+	uint64_t bitbuf;
+	int bitcount;
+	int failed;
+};
+
+static int opt_dist_code( unsigned int d )
+{
+	int b = 0;
+	unsigned int v;
+	if( d <= 4 ) return d - 1;
+	for( v = d - 1; v >>= 1; ) b++;
+	return 2 * b + ( ( ( d - 1 ) >> ( b - 1 ) ) & 1 );
+}
+
+static void opt_put_bits( struct optstate * s, uint32_t value, int n )
+{
+	s->bitbuf |= (uint64_t)value << s->bitcount;
+	s->bitcount += n;
+	while( s->bitcount >= 8 )
+	{
+		if( s->outlen == s->outcap )
+		{
+			uint8_t * grown = realloc( s->out, s->outcap * 2 );
+			if( !grown )
+			{
+				s->failed = 1;
+				s->outlen = 0;
+			}
+			else
+			{
+				s->out = grown;
+				s->outcap *= 2;
+			}
+		}
+		s->out[s->outlen++] = s->bitbuf;
+		s->bitbuf >>= 8;
+		s->bitcount -= 8;
+	}
+}
+
+// Huffman codes are sent most significant bit first.
+static void opt_put_code( struct optstate * s, uint32_t code, int n )
+{
+	uint32_t r = 0;
+	int i;
+	for( i = 0; i < n; i++ )
+		r |= ( ( code >> i ) & 1 ) << ( n - 1 - i );
+	opt_put_bits( s, r, n );
+}
+
+// Code lengths for `freqs`, none longer than `limit`. Lengths come from a
+// plain Huffman tree; if that is too deep the counts are halved (keeping
+// every used symbol) until it fits. At least two symbols always get a code,
+// so the decoder sees a complete tree.
+static void opt_huffman( const uint32_t * freqs, int n, int limit, uint8_t * lengths )
+{
+	uint32_t f[288];
+	int order[288];
+	uint32_t weight[2 * 288];
+	int parent[2 * 288];
+	int used = 0;
+	int i;
+
+	for( i = 0; i < n; i++ )
+	{
+		f[i] = freqs[i];
+		if( f[i] ) used++;
+	}
+	for( i = 0; used < 2 && i < n; i++ )
+	{
+		if( !f[i] )
+		{
+			f[i] = 1;
+			used++;
+		}
+	}
+
+	for( ;; )
+	{
+		int leaves = 0, nodes, li = 0, ni, maxlen = 0;
+
+		for( i = 0; i < n; i++ )
+		{
+			if( f[i] )
+			{
+				// Insertion sort by weight; n is at most 288.
+				int j = leaves++;
+				while( j > 0 && f[order[j-1]] > f[i] )
+				{
+					order[j] = order[j-1];
+					j--;
+				}
+				order[j] = i;
+			}
+		}
+
+		// Two queues: sorted leaves, and internal nodes, which are made in
+		// order of weight.
+		for( i = 0; i < leaves; i++ )
+			weight[i] = f[order[i]];
+		nodes = leaves;
+		ni = leaves;
+		while( nodes < 2 * leaves - 1 )
+		{
+			int pick[2], k;
+			for( k = 0; k < 2; k++ )
+			{
+				if( li < leaves && ( ni >= nodes || weight[li] <= weight[ni] ) )
+					pick[k] = li++;
+				else
+					pick[k] = ni++;
+			}
+			weight[nodes] = weight[pick[0]] + weight[pick[1]];
+			parent[pick[0]] = parent[pick[1]] = nodes;
+			nodes++;
+		}
+
+		// Depths, from the root down.
+		weight[nodes - 1] = 0;
+		for( i = nodes - 2; i >= 0; i-- )
+		{
+			weight[i] = weight[parent[i]] + 1;
+			if( i < leaves && (int)weight[i] > maxlen ) maxlen = weight[i];
+		}
+
+		if( maxlen <= limit )
+		{
+			memset( lengths, 0, n );
+			for( i = 0; i < leaves; i++ )
+				lengths[order[i]] = weight[i];
+			return;
+		}
+
+		for( i = 0; i < n; i++ )
+			if( f[i] ) f[i] = ( f[i] + 1 ) >> 1;
+	}
+}
+
+static void opt_canonical( const uint8_t * lengths, int n, uint16_t * codes )
+{
+	int count[16] = { 0 };
+	int next[16];
+	int i, code = 0;
+
+	for( i = 0; i < n; i++ )
+		count[lengths[i]]++;
+	count[0] = 0;
+	for( i = 1; i < 16; i++ )
+	{
+		code = ( code + count[i-1] ) << 1;
+		next[i] = code;
+	}
+	for( i = 0; i < n; i++ )
+		if( lengths[i] ) codes[i] = next[lengths[i]]++;
+}
+
+static void opt_histogram( struct optstate * s, const struct optsym * syms, size_t count, uint32_t * litfreq, uint32_t * distfreq )
+{
+	size_t i;
+	memset( litfreq, 0, sizeof( uint32_t ) * 288 );
+	memset( distfreq, 0, sizeof( uint32_t ) * 30 );
+	for( i = 0; i < count; i++ )
+	{
+		if( syms[i].dist )
+		{
+			litfreq[257 + s->lencode[syms[i].litlen]]++;
+			distfreq[opt_dist_code( syms[i].dist )]++;
+		}
+		else
+		{
+			litfreq[syms[i].litlen]++;
+		}
+	}
+	litfreq[256] = 1;
+}
+
+// Build the trees of a dynamic block and return the bits of its header.
+static uint64_t opt_build_trees( const uint32_t * litfreq, const uint32_t * distfreq, struct opttrees * t )
+{
+	uint8_t all[286 + 30];
+	uint32_t clfreq[19] = { 0 };
+	uint64_t bits;
+	int n, i;
+
+	opt_huffman( litfreq, 286, 15, t->litlen );
+	t->litlen[286] = t->litlen[287] = 0;
+	opt_huffman( distfreq, 30, 15, t->dist );
+
+	for( t->hlit = 286; t->hlit > 257 && !t->litlen[t->hlit - 1]; t->hlit-- );
+	for( t->hdist = 30; t->hdist > 1 && !t->dist[t->hdist - 1]; t->hdist-- );
+
+	// Run length code the lengths of both trees as one sequence.
+	memcpy( all, t->litlen, t->hlit );
+	memcpy( all + t->hlit, t->dist, t->hdist );
+	n = t->hlit + t->hdist;
+	t->rlecount = 0;
+	for( i = 0; i < n; )
+	{
+		int run = 1;
+		while( i + run < n && all[i + run] == all[i] ) run++;
+		i += run;
+
+		if( all[i - run] == 0 )
+		{
+			while( run >= 11 )
+			{
+				int r = run > 138 ? 138 : run;
+				t->rle[t->rlecount] = 18;
+				t->rleextra[t->rlecount++] = r - 11;
+				run -= r;
+			}
+			if( run >= 3 )
+			{
+				t->rle[t->rlecount] = 17;
+				t->rleextra[t->rlecount++] = run - 3;
+				run = 0;
+			}
+		}
+		else
+		{
+			t->rle[t->rlecount] = all[i - run];
+			t->rleextra[t->rlecount++] = 0;
+			run--;
+			while( run >= 3 )
+			{
+				int r = run > 6 ? 6 : run;
+				t->rle[t->rlecount] = 16;
+				t->rleextra[t->rlecount++] = r - 3;
+				run -= r;
+			}
+		}
+		while( run-- > 0 )
+		{
+			t->rle[t->rlecount] = all[i - 1];
+			t->rleextra[t->rlecount++] = 0;
+		}
+	}
+
+	for( i = 0; i < t->rlecount; i++ )
+		clfreq[t->rle[i]]++;
+	opt_huffman( clfreq, 19, 7, t->clen );
+	for( t->hclen = 19; t->hclen > 4 && !t->clen[opt_clen_order[t->hclen - 1]]; t->hclen-- );
+
+	opt_canonical( t->litlen, 288, t->litcode );
+	opt_canonical( t->dist, 30, t->distcode );
+	opt_canonical( t->clen, 19, t->clcode );
+
+	bits = 5 + 5 + 4 + 3 * t->hclen;
+	for( i = 0; i < t->rlecount; i++ )
+	{
+		static const int extra[3] = { 2, 3, 7 };
+		bits += t->clen[t->rle[i]];
+		if( t->rle[i] >= 16 ) bits += extra[t->rle[i] - 16];
+	}
+	return bits;
+}
+
+static uint64_t opt_data_bits( const uint32_t * litfreq, const uint32_t * distfreq, const uint8_t * litlen, const uint8_t * dist )
+{
+	uint64_t bits = 0;
+	int i;
+	for( i = 0; i < 286; i++ )
+		bits += (uint64_t)litfreq[i] * ( litlen[i] + ( i > 256 ? opt_len_extra[i - 257] : 0 ) );
+	for( i = 0; i < 30; i++ )
+		bits += (uint64_t)distfreq[i] * ( dist[i] + opt_dist_extra[i] );
+	return bits;
+}
+
+static void opt_fixed_lengths( uint8_t * litlen, uint8_t * dist )
+{
+	int i;
+	for( i = 0; i < 288; i++ )
+		litlen[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+	for( i = 0; i < 30; i++ )
+		dist[i] = 5;
+}
+
+static uint64_t opt_dynamic_bits( struct optstate * s, const struct optsym * syms, size_t count )
+{
+	uint32_t litfreq[288], distfreq[30];
+	struct opttrees t;
+	uint64_t header;
+	opt_histogram( s, syms, count, litfreq, distfreq );
+	header = opt_build_trees( litfreq, distfreq, &t );
+	return 3 + header + opt_data_bits( litfreq, distfreq, t.litlen, t.dist );
+}
+
+static uint64_t opt_fixed_bits( struct optstate * s, const struct optsym * syms, size_t count )
+{
+	uint32_t litfreq[288], distfreq[30];
+	uint8_t litlen[288], dist[30];
+	opt_histogram( s, syms, count, litfreq, distfreq );
+	opt_fixed_lengths( litlen, dist );
+	return 3 + opt_data_bits( litfreq, distfreq, litlen, dist );
+}
+
+static uint64_t opt_block_bits( struct optstate * s, const struct optsym * syms, size_t count )
+{
+	uint64_t d = opt_dynamic_bits( s, syms, count );
+	uint64_t f = opt_fixed_bits( s, syms, count );
+	return d < f ? d : f;
+}
+
+// Find the matches at every position of [start, end). Positions before
+// start are already in the hash chains.
+static int opt_find_matches( struct optstate * s, size_t start, size_t end )
+{
+	const uint8_t * data = s->data;
+	size_t pos;
+
+	s->mbase = start;
+	s->mcount = 0;
+
+	for( pos = start; pos < end; pos++ )
+	{
+		size_t limit = s->len - pos;
+		unsigned int h;
+		int32_t cand;
+		int chain = RTGZ_OPT_CHAIN;
+		size_t bestlen = 2;
+
+		s->mstart[pos - start] = s->mcount;
+		if( limit < 3 )
+			continue;
+		if( limit > RTGZ_OPT_MAX_MATCH )
+			limit = RTGZ_OPT_MAX_MATCH;
+
+		h = ( ( data[pos] << 10 ) ^ ( data[pos+1] << 5 ) ^ data[pos+2] ) & ( ( 1 << RTGZ_OPT_HASH_BITS ) - 1 );
+		cand = s->head[h];
+
+		while( cand >= 0 && pos - cand <= s->maxdist && chain-- > 0 )
+		{
+			const uint8_t * a = data + pos;
+			const uint8_t * b = data + cand;
+			int32_t next;
+
+			if( a[bestlen] == b[bestlen] )
+			{
+				size_t l = 0;
+				while( l < limit && a[l] == b[l] ) l++;
+				if( l > bestlen )
+				{
+					if( s->mcount + 2 > s->mcap )
+					{
+						uint16_t * grown = realloc( s->mlist, s->mcap * 2 * sizeof( uint16_t ) );
+						if( !grown ) return -1;
+						s->mlist = grown;
+						s->mcap *= 2;
+					}
+					s->mlist[s->mcount++] = l;
+					s->mlist[s->mcount++] = pos - cand;
+					bestlen = l;
+					if( l == limit )
+						break;
+				}
+			}
+
+			next = s->prev[cand & s->ringmask];
+			if( next >= cand )
+				break;
+			cand = next;
+		}
+
+		s->prev[pos & s->ringmask] = s->head[h];
+		s->head[h] = pos;
+	}
+	s->mstart[end - start] = s->mcount;
+
+	// Runs of one byte, for skipping through long repeats.
+	s->same[end - start - 1] = 1;
+	for( pos = end - 1; pos-- > start; )
+	{
+		uint16_t n = s->same[pos - start + 1];
+		s->same[pos - start] = data[pos] == data[pos+1] && n < 65535 ? n + 1 : 1;
+	}
+	return 0;
+}
+
+// Fixed costs for the first parse, the fixed Huffman code's lengths.
+static void opt_costs_fixed( struct optstate * s )
+{
+	int i;
+	for( i = 0; i < 256; i++ )
+		s->costs.lit[i] = i < 144 ? 8 : 9;
+	for( i = 3; i <= RTGZ_OPT_MAX_MATCH; i++ )
+	{
+		int c = s->lencode[i];
+		s->costs.len[i] = ( 257 + c < 280 ? 7 : 8 ) + opt_len_extra[c];
+	}
+	for( i = 1; i <= (int)s->maxdist; i++ )
+		s->costs.dist[i] = 5 + opt_dist_extra[opt_dist_code( i )];
+}
+
+// Costs as the entropy of the symbols of the last parse. A symbol that
+// wasn't used is priced as if it had been used once.
+static void opt_costs_from( struct optstate * s, const struct optsym * syms, size_t count )
+{
+	uint32_t litfreq[288], distfreq[30];
+	float litbits[288], distbits[30];
+	uint32_t littotal = 0, disttotal = 0;
+	int i;
+
+	opt_histogram( s, syms, count, litfreq, distfreq );
+	for( i = 0; i < 286; i++ ) littotal += litfreq[i];
+	for( i = 0; i < 30; i++ ) disttotal += distfreq[i];
+
+	for( i = 0; i < 286; i++ )
+		litbits[i] = log2( littotal ) - log2( litfreq[i] ? litfreq[i] : 1 );
+	for( i = 0; i < 30; i++ )
+		distbits[i] = disttotal ? log2( disttotal ) - log2( distfreq[i] ? distfreq[i] : 1 ) : 1;
+
+	for( i = 0; i < 256; i++ )
+		s->costs.lit[i] = litbits[i];
+	for( i = 3; i <= RTGZ_OPT_MAX_MATCH; i++ )
+	{
+		int c = s->lencode[i];
+		s->costs.len[i] = litbits[257 + c] + opt_len_extra[c];
+	}
+	for( i = 1; i <= (int)s->maxdist; i++ )
+	{
+		int c = opt_dist_code( i );
+		s->costs.dist[i] = distbits[c] + opt_dist_extra[c];
+	}
+}
+
+// Cheapest parse of [start, end) under the current costs, into s->syms.
+static size_t opt_parse( struct optstate * s, size_t start, size_t end )
+{
+	const double inf = 1e300;
+	size_t n = end - start;
+	size_t k, count = 0;
+
+	s->cost[0] = 0;
+	for( k = 1; k <= n; k++ )
+		s->cost[k] = inf;
+
+	for( k = 0; k < n; k++ )
+	{
+		size_t pos = start + k;
+		size_t m = pos - s->mbase;
+		double base = s->cost[k];
+		double c;
+		uint32_t e;
+		unsigned int prevlen = 2;
+
+		if( base >= inf )
+			continue;
+
+		c = base + s->costs.lit[s->data[pos]];
+		if( c < s->cost[k + 1] )
+		{
+			s->cost[k + 1] = c;
+			s->choicelen[k + 1] = 1;
+			s->choicedist[k + 1] = 0;
+		}
+
+		// In a long run of one byte, only the longest match at distance 1
+		// is worth trying, which keeps this linear on zero fill.
+		if( pos > 0 && s->data[pos - 1] == s->data[pos] && s->same[m] > 2 * RTGZ_OPT_MAX_MATCH
+			&& k + RTGZ_OPT_MAX_MATCH <= n )
+		{
+			c = base + s->costs.len[RTGZ_OPT_MAX_MATCH] + s->costs.dist[1];
+			if( c < s->cost[k + RTGZ_OPT_MAX_MATCH] )
+			{
+				s->cost[k + RTGZ_OPT_MAX_MATCH] = c;
+				s->choicelen[k + RTGZ_OPT_MAX_MATCH] = RTGZ_OPT_MAX_MATCH;
+				s->choicedist[k + RTGZ_OPT_MAX_MATCH] = 1;
+			}
+			continue;
+		}
+
+		for( e = s->mstart[m]; e < s->mstart[m + 1]; e += 2 )
+		{
+			unsigned int len = s->mlist[e];
+			unsigned int dist = s->mlist[e + 1];
+			double dc = base + s->costs.dist[dist];
+			unsigned int l;
+
+			if( len > n - k )
+				len = n - k;
+			for( l = prevlen + 1; l <= len; l++ )
+			{
+				c = dc + s->costs.len[l];
+				if( c < s->cost[k + l] )
+				{
+					s->cost[k + l] = c;
+					s->choicelen[k + l] = l;
+					s->choicedist[k + l] = dist;
+				}
+			}
+			if( len == n - k )
+				break;
+			prevlen = len;
+		}
+	}
+
+	// Walk back from the end, then put the symbols in order.
+	for( k = n; k > 0; k -= s->choicelen[k] )
+	{
+		s->syms[count].litlen = s->choicedist[k] ? s->choicelen[k] : s->data[start + k - 1];
+		s->syms[count].dist = s->choicedist[k];
+		count++;
+	}
+	for( k = 0; k < count / 2; k++ )
+	{
+		struct optsym t = s->syms[k];
+		s->syms[k] = s->syms[count - 1 - k];
+		s->syms[count - 1 - k] = t;
+	}
+	return count;
+}
+
+static void opt_write_symbols( struct optstate * s, const struct optsym * syms, size_t count,
+	const uint8_t * litlen, const uint16_t * litcode, const uint8_t * dist, const uint16_t * distcode )
+{
+	size_t i;
+	for( i = 0; i < count; i++ )
+	{
+		if( syms[i].dist )
+		{
+			int lc = s->lencode[syms[i].litlen];
+			int dc = opt_dist_code( syms[i].dist );
+			opt_put_code( s, litcode[257 + lc], litlen[257 + lc] );
+			opt_put_bits( s, syms[i].litlen - opt_len_base[lc], opt_len_extra[lc] );
+			opt_put_code( s, distcode[dc], dist[dc] );
+			opt_put_bits( s, syms[i].dist - opt_dist_base[dc], opt_dist_extra[dc] );
+		}
+		else
+		{
+			opt_put_code( s, litcode[syms[i].litlen], litlen[syms[i].litlen] );
+		}
+	}
+	opt_put_code( s, litcode[256], litlen[256] );
+}
+
+static void opt_write_stored( struct optstate * s, size_t start, size_t end, int last )
+{
+	do
+	{
+		size_t n = end - start > 65535 ? 65535 : end - start;
+		size_t i;
+		opt_put_bits( s, last && start + n == end, 1 );
+		opt_put_bits( s, 0, 2 );
+		if( s->bitcount )
+			opt_put_bits( s, 0, 8 - s->bitcount );
+		opt_put_bits( s, n, 16 );
+		opt_put_bits( s, ~n & 0xffff, 16 );
+		for( i = 0; i < n; i++ )
+			opt_put_bits( s, s->data[start + i], 8 );
+		start += n;
+	} while( start < end );
+}
+
+// Parse [start, end) a number of times, refining the costs, and write it as
+// the smallest kind of block.
+static void opt_compress_block( struct optstate * s, size_t start, size_t end, int last )
+{
+	uint32_t litfreq[288], distfreq[30];
+	uint64_t bestbits = ~(uint64_t)0, fixedbits, storedbits;
+	size_t bestcount = 0, fixedcount, count;
+	int i;
+
+	opt_costs_fixed( s );
+	fixedcount = opt_parse( s, start, end );
+	memcpy( s->fixed, s->syms, fixedcount * sizeof( struct optsym ) );
+	fixedbits = opt_fixed_bits( s, s->fixed, fixedcount );
+
+	count = fixedcount;
+	for( i = 0; ; i++ )
+	{
+		uint64_t bits = opt_dynamic_bits( s, s->syms, count );
+		if( bits < bestbits )
+		{
+			bestbits = bits;
+			bestcount = count;
+			memcpy( s->best, s->syms, count * sizeof( struct optsym ) );
+		}
+		if( i == RTGZ_OPT_ITERATIONS )
+			break;
+		opt_costs_from( s, s->syms, count );
+		count = opt_parse( s, start, end );
+	}
+
+	storedbits = ( ( end - start ) / 65535 + 1 ) * ( 3 + 7 + 32 ) + 8 * (uint64_t)( end - start );
+
+	if( storedbits <= bestbits && storedbits <= fixedbits )
+	{
+		opt_write_stored( s, start, end, last );
+	}
+	else if( fixedbits <= bestbits )
+	{
+		uint8_t litlen[288], dist[30];
+		uint16_t litcode[288], distcode[30];
+		opt_fixed_lengths( litlen, dist );
+		opt_canonical( litlen, 288, litcode );
+		opt_canonical( dist, 30, distcode );
+		opt_put_bits( s, last, 1 );
+		opt_put_bits( s, 1, 2 );
+		opt_write_symbols( s, s->fixed, fixedcount, litlen, litcode, dist, distcode );
+	}
+	else
+	{
+		struct opttrees t;
+		opt_histogram( s, s->best, bestcount, litfreq, distfreq );
+		opt_build_trees( litfreq, distfreq, &t );
+		opt_put_bits( s, last, 1 );
+		opt_put_bits( s, 2, 2 );
+		opt_put_bits( s, t.hlit - 257, 5 );
+		opt_put_bits( s, t.hdist - 1, 5 );
+		opt_put_bits( s, t.hclen - 4, 4 );
+		for( i = 0; i < t.hclen; i++ )
+			opt_put_bits( s, t.clen[opt_clen_order[i]], 3 );
+		for( i = 0; i < t.rlecount; i++ )
+		{
+			static const int extra[3] = { 2, 3, 7 };
+			opt_put_code( s, t.clcode[t.rle[i]], t.clen[t.rle[i]] );
+			if( t.rle[i] >= 16 )
+				opt_put_bits( s, t.rleextra[i], extra[t.rle[i] - 16] );
+		}
+		opt_write_symbols( s, s->best, bestcount, t.litlen, t.litcode, t.dist, t.distcode );
+	}
+}
+
+// Split syms[a, b) where two blocks come out smaller than one, narrowing in
+// on the best split point from evenly spaced samples. Split points are
+// added to `splits` in order.
+static void opt_split( struct optstate * s, const struct optsym * syms, size_t a, size_t b,
+	size_t * splits, int * nsplits, int maxsplits )
+{
+	uint64_t whole, bestbits = ~(uint64_t)0;
+	size_t lo = a + RTGZ_OPT_MINSPLIT, hi = b - RTGZ_OPT_MINSPLIT, best = 0;
+
+	if( b - a < 2 * RTGZ_OPT_MINSPLIT || *nsplits >= maxsplits )
+		return;
+
+	while( hi > lo )
+	{
+		size_t step = ( hi - lo ) / 8 + 1;
+		size_t p;
+		for( p = lo; p <= hi; p += step )
+		{
+			uint64_t bits = opt_block_bits( s, syms + a, p - a ) + opt_block_bits( s, syms + p, b - p );
+			if( bits < bestbits )
+			{
+				bestbits = bits;
+				best = p;
+			}
+		}
+		if( step == 1 )
+			break;
+		lo = best > lo + step ? best - step : lo;
+		hi = best + step < hi ? best + step : hi;
+	}
+
+	whole = opt_block_bits( s, syms + a, b - a );
+	if( !best || bestbits >= whole )
+		return;
+
+	opt_split( s, syms, a, best, splits, nsplits, maxsplits );
+	if( *nsplits < maxsplits )
+		splits[(*nsplits)++] = best;
+	opt_split( s, syms, best, b, splits, nsplits, maxsplits );
+}
+
+static void opt_free( struct optstate * s )
+{
+	free( s->head );
+	free( s->prev );
+	free( s->mstart );
+	free( s->mlist );
+	free( s->same );
+	free( s->cost );
+	free( s->choicelen );
+	free( s->choicedist );
+	free( s->syms );
+	free( s->best );
+	free( s->fixed );
+	free( s->sympos );
+	free( s->costs.dist );
+}
+
+// Compress `len` bytes of `src` into a malloc'd raw deflate stream, with no
+// match reaching back 1 << window_bits or more. Returns 0 on success.
+static int rtgz_opt_compress( const uint8_t * src, size_t len, int window_bits, uint8_t ** out, size_t * outlen )
+{
+	struct optstate s;
+	size_t master = len < RTGZ_OPT_MASTER ? len : RTGZ_OPT_MASTER;
+	size_t start;
+	int i;
+
+	memset( &s, 0, sizeof( s ) );
+	s.data = src;
+	s.len = len;
+	s.maxdist = ( 1u << window_bits ) - 1;
+	s.ringmask = ( 1u << window_bits ) - 1;
+	s.mcap = 1 << 16;
+	s.outcap = 1 << 16;
+
+	s.head = malloc( sizeof( int32_t ) << RTGZ_OPT_HASH_BITS );
+	s.prev = malloc( sizeof( int32_t ) << window_bits );
+	s.mstart = malloc( sizeof( uint32_t ) * ( master + 1 ) );
+	s.mlist = malloc( sizeof( uint16_t ) * s.mcap );
+	s.same = malloc( sizeof( uint16_t ) * ( master + 1 ) );
+	s.cost = malloc( sizeof( double ) * ( master + 1 ) );
+	s.choicelen = malloc( sizeof( uint16_t ) * ( master + 1 ) );
+	s.choicedist = malloc( sizeof( uint16_t ) * ( master + 1 ) );
+	s.syms = malloc( sizeof( struct optsym ) * ( master + 1 ) );
+	s.best = malloc( sizeof( struct optsym ) * ( master + 1 ) );
+	s.fixed = malloc( sizeof( struct optsym ) * ( master + 1 ) );
+	s.sympos = malloc( sizeof( size_t ) * ( master + 1 ) );
+	s.costs.dist = malloc( sizeof( float ) << window_bits );
+	s.out = malloc( s.outcap );
+
+	if( !s.head || !s.prev || !s.mstart || !s.mlist || !s.same || !s.cost || !s.choicelen || !s.choicedist
+		|| !s.syms || !s.best || !s.fixed || !s.sympos || !s.costs.dist || !s.out )
+	{
+		opt_free( &s );
+		free( s.out );
+		return -1;
+	}
+
+	for( i = 0; i < ( 1 << RTGZ_OPT_HASH_BITS ); i++ )
+		s.head[i] = -1;
+	for( i = 0; i < 29; i++ )
+	{
+		int l;
+		for( l = opt_len_base[i]; l < ( i < 28 ? opt_len_base[i + 1] : RTGZ_OPT_MAX_MATCH + 1 ); l++ )
+			s.lencode[l] = i;
+	}
+
+	if( len == 0 )
+	{
+		// Just an empty final block.
+		opt_put_bits( &s, 3, 3 );
+		opt_put_bits( &s, 0, 7 );
+	}
+
+	for( start = 0; start < len; start += master )
+	{
+		size_t end = start + master < len ? start + master : len;
+		size_t splits[RTGZ_OPT_MAXBLOCKS];
+		int nsplits = 0;
+		size_t count, k, pos, from;
+
+		if( opt_find_matches( &s, start, end ) )
+		{
+			s.failed = 1;
+			break;
+		}
+
+		// Split on a parse with fixed costs, which is cheap and close to
+		// what the final parse will be.
+		opt_costs_fixed( &s );
+		count = opt_parse( &s, start, end );
+		memcpy( s.best, s.syms, count * sizeof( struct optsym ) );
+		opt_split( &s, s.best, 0, count, splits, &nsplits, RTGZ_OPT_MAXBLOCKS - 1 );
+
+		for( k = 0, pos = start; k < count; k++ )
+		{
+			s.sympos[k] = pos;
+			pos += s.best[k].dist ? s.best[k].litlen : 1;
+		}
+
+		from = start;
+		for( i = 0; i <= nsplits; i++ )
+		{
+			size_t to = i < nsplits ? s.sympos[splits[i]] : end;
+			opt_compress_block( &s, from, to, to == len );
+			from = to;
+		}
+	}
+
+	// Pad out the last byte.
+	if( s.bitcount )
+		opt_put_bits( &s, 0, 8 - s.bitcount );
+
+	opt_free( &s );
+	if( s.failed )
+	{
+		free( s.out );
+		return -1;
+	}
+	*out = s.out;
+	*outlen = s.outlen;
+	return 0;
+}
+
+#endif
@@ -0,0 +1,1006 @@
+/*
+ * tdefl - tiny deflate compressor, the companion to tinf_sf.h
+ *
+ * Copyright (c) 2024 Charles Lohr
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ *   1. The origin of this software must not be misrepresented; you must
+ *      not claim that you wrote the original software. If you use this
+ *      software in a product, an acknowledgment in the product
+ *      documentation would be appreciated but is not required.
+ *
+ *   2. Altered source versions must be plainly marked as such, and must
+ *      not be misrepresented as being the original software.
+ *
+ *   3. This notice may not be removed or altered from any source
+ *      distribution.
+ */
+
+/*
+
+
+    If you want to have the implementation.
+
+  #define TDEFL_IMPLEMENTATION
+
+    Configuration tuning:
+
+  #define TDEFL_STREAM 0
+  #define TDEFL_BUFFER 1
+  #define TDEFL_WINDOW_SIZE 32768
+  #define TDEFL_HASH_BITS 10
+  #define TDEFL_MAX_CHAIN 32
+  #define TDEFL_LAZY 1
+  #define TDEFL_DYNAMIC 1
+  #define TDEFL_BLOCK_SYMBOLS 2048
+
+    Output is raw deflate, with no match reaching back TDEFL_WINDOW_SIZE
+  bytes or more, so it decodes with tinf_stream_uncompress built with the
+  same TINF_STREAM_BUFFER_SIZE.
+
+    All state lives in struct tdefl_data, which the compress functions
+  keep on the stack.  It holds 2 * TDEFL_WINDOW_SIZE bytes of input in
+  stream mode, a hash table of (1 << TDEFL_HASH_BITS) positions, one
+  position per window byte for the hash chains, and, with TDEFL_DYNAMIC,
+  3 * TDEFL_BLOCK_SYMBOLS bytes of symbols for the block being built.
+  Positions are 2 bytes for windows up to 16384.  With a 512 byte window
+  that is about 9 kB, plus around 3 kB more of stack while a block's
+  Huffman trees are built.
+
+    TDEFL_DYNAMIC 0 only emits fixed Huffman blocks, which needs no symbol
+  buffer and no tree building, at some cost in ratio.  TDEFL_LAZY tries
+  one position ahead before taking a match, like zlib's higher levels.
+  TDEFL_MAX_CHAIN limits how many earlier positions are tried per match.
+*/
+
+#ifndef TDEFL_H_INCLUDED
+#define TDEFL_H_INCLUDED
+
+#ifndef TDEFL_STREAM
+#define TDEFL_STREAM 0
+#endif
+
+#ifndef TDEFL_BUFFER
+#define TDEFL_BUFFER 1
+#endif
+
+#ifndef TDEFL_WINDOW_SIZE
+#define TDEFL_WINDOW_SIZE 32768
+#endif
+
+#if TDEFL_WINDOW_SIZE < 512 || TDEFL_WINDOW_SIZE > 32768 || (TDEFL_WINDOW_SIZE & (TDEFL_WINDOW_SIZE - 1))
+#  error "TDEFL_WINDOW_SIZE must be a power of two from 512 to 32768"
+#endif
+
+#ifndef TDEFL_HASH_BITS
+#define TDEFL_HASH_BITS 10
+#endif
+
+#ifndef TDEFL_MAX_CHAIN
+#define TDEFL_MAX_CHAIN 32
+#endif
+
+#ifndef TDEFL_LAZY
+#define TDEFL_LAZY 1
+#endif
+
+#ifndef TDEFL_DYNAMIC
+#define TDEFL_DYNAMIC 1
+#endif
+
+#ifndef TDEFL_BLOCK_SYMBOLS
+#define TDEFL_BLOCK_SYMBOLS 2048
+#endif
+
+/* Symbol counts have to fit the 16-bit tree builder */
+#if TDEFL_BLOCK_SYMBOLS < 64 || TDEFL_BLOCK_SYMBOLS > 16384
+#  error "TDEFL_BLOCK_SYMBOLS must be between 64 and 16384"
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef TDEFLCC
+#  ifdef __WATCOMC__
+#    define TDEFLCC __cdecl
+#  else
+#    define TDEFLCC
+#  endif
+#endif
+
+/* -- Encoder state -- */
+
+#if TDEFL_WINDOW_SIZE <= 16384
+typedef unsigned short tdefl_pos;
+#else
+typedef unsigned int tdefl_pos;
+#endif
+
+/*
+ * Public so its size can be checked, but all fields are private to tdefl.
+ */
+struct tdefl_data {
+	const unsigned char *win; /* Input being matched in */
+	unsigned int pos;         /* Next byte of win to encode */
+	unsigned int avail;       /* Bytes of win holding input */
+	int done;                 /* Nothing follows win[avail - 1] */
+	unsigned int max_dist;
+#if TDEFL_BUFFER == 1
+	const unsigned char *source_end;
+	unsigned char *dest;
+	unsigned char *dest_end;
+#endif
+#if TDEFL_STREAM == 1
+	int (*feed)( void * );
+	int (*produce)( void *, uint8_t );
+	void * opaque;
+	unsigned char window[2 * TDEFL_WINDOW_SIZE];
+#endif
+	unsigned int bitbuf;
+	int bitcount;
+	int error;
+
+	tdefl_pos head[1 << TDEFL_HASH_BITS]; /* Last position + 1 with a hash */
+	tdefl_pos prev[TDEFL_WINDOW_SIZE];    /* Position + 1 before it, by hash */
+
+#if TDEFL_DYNAMIC == 1
+	unsigned int nsyms;
+	unsigned char sym_lit[TDEFL_BLOCK_SYMBOLS];   /* Literal, or length - 3 */
+	unsigned short sym_dist[TDEFL_BLOCK_SYMBOLS]; /* 0 for a literal */
+#endif
+};
+
+/**
+ * Status codes returned.
+ *
+ * @see tdefl_compress, tdefl_stream_compress
+ */
+typedef enum {
+	TDEFL_OK        = 0, /**< Success */
+	TDEFL_BUF_ERROR = -5 /**< Not enough room for output */
+} tdefl_error_code;
+
+#if TDEFL_BUFFER == 1
+/**
+ * Compress `sourceLen` bytes from `source` to `dest` as raw deflate.
+ *
+ * On entry, `destLen` is the size of `dest`, on return it is the size of
+ * the compressed data.
+ *
+ * @param dest pointer to where to place compressed data
+ * @param destLen pointer to variable containing size of `dest`
+ * @param source pointer to data to compress
+ * @param sourceLen size of data to compress
+ * @return `TDEFL_OK` on success, `TDEFL_BUF_ERROR` if `dest` is too small.
+ */
+int TDEFLCC tdefl_compress(void *dest, unsigned int *destLen,
+                           const void *source, unsigned int sourceLen);
+#endif
+
+#if TDEFL_STREAM == 1
+/**
+ * Compress data provided by `feed`, where each call returns another byte
+ * or a negative value at the end, and hand the raw deflate output to
+ * `produce` a byte at a time.
+ *
+ * @param feed function pointer to function providing data to compress
+ * @param produce function pointer to accept compressed data, returning a
+ *        negative value aborts with `TDEFL_BUF_ERROR`
+ * @return `TDEFL_OK` on success, error code on error.
+ */
+int TDEFLCC tdefl_stream_compress( int (*feed)( void * ),
+	int (*produce)( void *, uint8_t ), void * opaque );
+
+/**
+ * Like tdefl_stream_compress, but no match reaches back `1 << window_bits`
+ * bytes or more, for a decoder with a smaller window than
+ * `TDEFL_WINDOW_SIZE`.
+ *
+ * @param window_bits window size in bits, at most the size of
+ *        `TDEFL_WINDOW_SIZE` in bits
+ * @return `TDEFL_OK` on success, error code on error.
+ */
+int TDEFLCC tdefl_stream_compress_window( int (*feed)( void * ),
+	int (*produce)( void *, uint8_t ), void * opaque,
+	unsigned int window_bits );
+#endif
+
+#endif /* TDEFL_H_INCLUDED */
+
+#ifdef TDEFL_IMPLEMENTATION
+
+#include <string.h>
+
+/* Input kept beyond the current position, enough for a full match */
+#define TDEFL_MIN_LOOKAHEAD (258 + 3 + 1)
+
+static const unsigned short tdefl_length_base[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+
+static const unsigned char tdefl_length_bits[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+static const unsigned short tdefl_dist_base[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+	8193, 12289, 16385, 24577
+};
+
+static const unsigned char tdefl_dist_bits[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+/* -- Output -- */
+
+static void tdefl_put_byte(struct tdefl_data *d, unsigned char c)
+{
+#if TDEFL_STREAM == 1
+	if (d->feed) {
+		if (d->produce(d->opaque, c) < 0) {
+			d->error = TDEFL_BUF_ERROR;
+		}
+		return;
+	}
+#endif
+#if TDEFL_BUFFER == 1
+	if (d->dest == d->dest_end) {
+		d->error = TDEFL_BUF_ERROR;
+		return;
+	}
+	*d->dest++ = c;
+#endif
+}
+
+/* Send the low n bits of value, least significant first */
+static void tdefl_put_bits(struct tdefl_data *d, unsigned int value, int n)
+{
+	d->bitbuf |= value << d->bitcount;
+	d->bitcount += n;
+
+	while (d->bitcount >= 8) {
+		tdefl_put_byte(d, d->bitbuf & 0xFF);
+		d->bitbuf >>= 8;
+		d->bitcount -= 8;
+	}
+}
+
+/* Send a Huffman code, which goes most significant bit first */
+static void tdefl_put_code(struct tdefl_data *d, unsigned int code, int n)
+{
+	unsigned int rev = 0;
+	int i;
+
+	for (i = 0; i < n; ++i) {
+		rev = (rev << 1) | ((code >> i) & 1);
+	}
+
+	tdefl_put_bits(d, rev, n);
+}
+
+static int tdefl_length_code(unsigned int length)
+{
+	int c = 28;
+
+	while (length < tdefl_length_base[c]) {
+		--c;
+	}
+
+	return c;
+}
+
+static int tdefl_dist_code(unsigned int dist)
+{
+	unsigned int v = dist - 1;
+	int b = 0;
+
+	if (dist <= 4) {
+		return dist - 1;
+	}
+
+	while (v >> (b + 1)) {
+		++b;
+	}
+
+	return 2 * b + ((v >> (b - 1)) & 1);
+}
+
+/* Length and code of a symbol in the fixed Huffman code */
+static void tdefl_fixed_code(unsigned int sym, unsigned int *code, int *len)
+{
+	if (sym < 144) {
+		*code = 0x30 + sym;
+		*len = 8;
+	}
+	else if (sym < 256) {
+		*code = 0x190 + sym - 144;
+		*len = 9;
+	}
+	else if (sym < 280) {
+		*code = sym - 256;
+		*len = 7;
+	}
+	else {
+		*code = 0xC0 + sym - 280;
+		*len = 8;
+	}
+}
+
+static void tdefl_put_fixed_symbol(struct tdefl_data *d, unsigned int lit,
+                                   unsigned int length, unsigned int dist)
+{
+	unsigned int code;
+	int len;
+
+	if (!dist) {
+		tdefl_fixed_code(lit, &code, &len);
+		tdefl_put_code(d, code, len);
+	}
+	else {
+		int lc = tdefl_length_code(length);
+		int dc = tdefl_dist_code(dist);
+
+		tdefl_fixed_code(257 + lc, &code, &len);
+		tdefl_put_code(d, code, len);
+		tdefl_put_bits(d, length - tdefl_length_base[lc], tdefl_length_bits[lc]);
+		tdefl_put_code(d, dc, 5);
+		tdefl_put_bits(d, dist - tdefl_dist_base[dc], tdefl_dist_bits[dc]);
+	}
+}
+
+#if TDEFL_DYNAMIC == 1
+
+/* -- Dynamic blocks -- */
+
+static const unsigned char tdefl_clen_order[19] = {
+	16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+/*
+ * Code lengths for the `num` symbols with counts in `freq`, none longer
+ * than `limit`. If the Huffman tree is too deep, the counts are halved,
+ * keeping every used symbol, and it is built again. At least two symbols
+ * get a code, so the tree is always complete.
+ */
+static void tdefl_build_lengths(const unsigned short *freq, int num, int limit,
+                                unsigned char *lengths)
+{
+	unsigned short f[286];
+	unsigned short order[286];
+	unsigned short weight[2 * 286];
+	unsigned short parent[2 * 286];
+	int used = 0;
+	int i;
+
+	for (i = 0; i < num; ++i) {
+		f[i] = freq[i];
+		used += f[i] != 0;
+	}
+
+	for (i = 0; used < 2; ++i) {
+		if (!f[i]) {
+			f[i] = 1;
+			++used;
+		}
+	}
+
+	for (;;) {
+		int leaves = 0, nodes, li = 0, ni, maxlen = 0;
+
+		/* Sort used symbols by count */
+		for (i = 0; i < num; ++i) {
+			if (f[i]) {
+				int j = leaves++;
+
+				while (j > 0 && f[order[j - 1]] > f[i]) {
+					order[j] = order[j - 1];
+					--j;
+				}
+
+				order[j] = i;
+			}
+		}
+
+		/* Merge from two queues, the sorted leaves and the new nodes */
+		for (i = 0; i < leaves; ++i) {
+			weight[i] = f[order[i]];
+		}
+
+		for (nodes = ni = leaves; nodes < 2 * leaves - 1; ++nodes) {
+			int k;
+
+			for (k = 0; k < 2; ++k) {
+				int pick;
+
+				if (li < leaves && (ni >= nodes || weight[li] <= weight[ni])) {
+					pick = li++;
+				}
+				else {
+					pick = ni++;
+				}
+
+				parent[pick] = nodes;
+				weight[nodes] = k ? weight[nodes] + weight[pick] : weight[pick];
+			}
+		}
+
+		/* Depths, from the root down */
+		weight[nodes - 1] = 0;
+
+		for (i = nodes - 2; i >= 0; --i) {
+			weight[i] = weight[parent[i]] + 1;
+
+			if (i < leaves && weight[i] > maxlen) {
+				maxlen = weight[i];
+			}
+		}
+
+		if (maxlen <= limit) {
+			memset(lengths, 0, num);
+
+			for (i = 0; i < leaves; ++i) {
+				lengths[order[i]] = (unsigned char) weight[i];
+			}
+
+			return;
+		}
+
+		for (i = 0; i < num; ++i) {
+			f[i] = (f[i] + 1) >> 1;
+		}
+	}
+}
+
+/* Canonical codes for a set of code lengths */
+static void tdefl_build_codes(const unsigned char *lengths, int num,
+                              unsigned short *codes)
+{
+	unsigned short next[16];
+	unsigned short counts[16] = { 0 };
+	unsigned int code = 0;
+	int i;
+
+	for (i = 0; i < num; ++i) {
+		counts[lengths[i]]++;
+	}
+
+	counts[0] = 0;
+
+	for (i = 1; i < 16; ++i) {
+		code = (code + counts[i - 1]) << 1;
+		next[i] = code;
+	}
+
+	for (i = 0; i < num; ++i) {
+		if (lengths[i]) {
+			codes[i] = next[lengths[i]]++;
+		}
+	}
+}
+
+/*
+ * Run length code the code lengths of both trees. If `out` is NULL, only
+ * count the code length symbols into `freq`, otherwise send them.
+ */
+static void tdefl_send_lengths(struct tdefl_data *d, const unsigned char *lengths,
+                               int num, unsigned short *freq,
+                               const unsigned char *clen, const unsigned short *ccode)
+{
+	int i = 0;
+
+	while (i < num) {
+		unsigned int sym[3], extra[3], nsym = 0, k;
+		int run = 1;
+
+		while (i + run < num && lengths[i + run] == lengths[i]) {
+			++run;
+		}
+
+		if (lengths[i] == 0 && run >= 11) {
+			if (run > 138) {
+				run = 138;
+			}
+			sym[0] = 18;
+			extra[0] = run - 11;
+			nsym = 1;
+		}
+		else if (lengths[i] == 0 && run >= 3) {
+			sym[0] = 17;
+			extra[0] = run - 3;
+			nsym = 1;
+		}
+		else if (lengths[i] != 0 && run >= 4) {
+			if (run > 7) {
+				run = 7;
+			}
+			sym[0] = lengths[i];
+			extra[0] = 0;
+			sym[1] = 16;
+			extra[1] = run - 4;
+			nsym = 2;
+		}
+		else {
+			run = 1;
+			sym[0] = lengths[i];
+			extra[0] = 0;
+			nsym = 1;
+		}
+
+		for (k = 0; k < nsym; ++k) {
+			if (freq) {
+				freq[sym[k]]++;
+			}
+			else {
+				tdefl_put_code(d, ccode[sym[k]], clen[sym[k]]);
+
+				if (sym[k] >= 16) {
+					static const unsigned char bits[3] = { 2, 3, 7 };
+
+					tdefl_put_bits(d, extra[k], bits[sym[k] - 16]);
+				}
+			}
+		}
+
+		i += run;
+	}
+}
+
+/* Bits to send the buffered symbols with the given code lengths */
+static unsigned long tdefl_data_bits(const unsigned short *lfreq,
+                                     const unsigned short *dfreq,
+                                     const unsigned char *llen,
+                                     const unsigned char *dlen)
+{
+	unsigned long bits = 0;
+	int i;
+
+	for (i = 0; i < 286; ++i) {
+		bits += (unsigned long) lfreq[i]
+		      * (llen[i] + (i > 256 ? tdefl_length_bits[i - 257] : 0));
+	}
+
+	for (i = 0; i < 30; ++i) {
+		bits += (unsigned long) dfreq[i] * (dlen[i] + tdefl_dist_bits[i]);
+	}
+
+	return bits;
+}
+
+/* Send the buffered symbols as a fixed or dynamic block, whichever is smaller */
+static void tdefl_flush_block(struct tdefl_data *d, int final)
+{
+	unsigned short lfreq[286], dfreq[30], cfreq[19];
+	unsigned char lengths[286 + 30], fixed[286 + 30], seq[286 + 30], clen[19];
+	unsigned short lcode[286], dcode[30], ccode[19];
+	unsigned long dynbits, fixbits;
+	int hlit, hdist, hclen;
+	unsigned int i;
+
+	memset(lfreq, 0, sizeof(lfreq));
+	memset(dfreq, 0, sizeof(dfreq));
+	memset(cfreq, 0, sizeof(cfreq));
+
+	for (i = 0; i < d->nsyms; ++i) {
+		if (d->sym_dist[i]) {
+			lfreq[257 + tdefl_length_code(d->sym_lit[i] + 3)]++;
+			dfreq[tdefl_dist_code(d->sym_dist[i])]++;
+		}
+		else {
+			lfreq[d->sym_lit[i]]++;
+		}
+	}
+
+	lfreq[256] = 1;
+
+	tdefl_build_lengths(lfreq, 286, 15, lengths);
+	tdefl_build_lengths(dfreq, 30, 15, lengths + 286);
+
+	for (hlit = 286; hlit > 257 && !lengths[hlit - 1]; --hlit) {
+	}
+
+	for (hdist = 30; hdist > 1 && !lengths[286 + hdist - 1]; --hdist) {
+	}
+
+	/* Both sets of lengths are run length coded as one sequence */
+	memcpy(seq, lengths, hlit);
+	memcpy(seq + hlit, lengths + 286, hdist);
+	tdefl_send_lengths(d, seq, hlit + hdist, cfreq, 0, 0);
+	tdefl_build_lengths(cfreq, 19, 7, clen);
+
+	for (hclen = 19; hclen > 4 && !clen[tdefl_clen_order[hclen - 1]]; --hclen) {
+	}
+
+	dynbits = 14 + 3 * hclen;
+
+	for (i = 0; i < 19; ++i) {
+		dynbits += (unsigned long) cfreq[i]
+		         * (clen[i] + (i == 16 ? 2 : i == 17 ? 3 : i == 18 ? 7 : 0));
+	}
+
+	for (i = 0; i < 286 + 30; ++i) {
+		unsigned int code;
+		int len = 5;
+
+		if (i < 286) {
+			tdefl_fixed_code(i, &code, &len);
+		}
+
+		fixed[i] = (unsigned char) len;
+	}
+
+	dynbits += tdefl_data_bits(lfreq, dfreq, lengths, lengths + 286);
+	fixbits = tdefl_data_bits(lfreq, dfreq, fixed, fixed + 286);
+
+	tdefl_put_bits(d, final, 1);
+
+	if (fixbits <= dynbits) {
+		tdefl_put_bits(d, 1, 2);
+
+		for (i = 0; i < d->nsyms; ++i) {
+			tdefl_put_fixed_symbol(d, d->sym_lit[i], d->sym_lit[i] + 3, d->sym_dist[i]);
+		}
+
+		tdefl_put_code(d, 0, 7);
+		d->nsyms = 0;
+		return;
+	}
+
+	tdefl_build_codes(lengths, 286, lcode);
+	tdefl_build_codes(lengths + 286, 30, dcode);
+	tdefl_build_codes(clen, 19, ccode);
+
+	tdefl_put_bits(d, 2, 2);
+	tdefl_put_bits(d, hlit - 257, 5);
+	tdefl_put_bits(d, hdist - 1, 5);
+	tdefl_put_bits(d, hclen - 4, 4);
+
+	for (i = 0; i < (unsigned int) hclen; ++i) {
+		tdefl_put_bits(d, clen[tdefl_clen_order[i]], 3);
+	}
+
+	tdefl_send_lengths(d, seq, hlit + hdist, 0, clen, ccode);
+
+	for (i = 0; i < d->nsyms; ++i) {
+		unsigned int dist = d->sym_dist[i];
+
+		if (!dist) {
+			unsigned int c = d->sym_lit[i];
+
+			tdefl_put_code(d, lcode[c], lengths[c]);
+		}
+		else {
+			unsigned int length = d->sym_lit[i] + 3;
+			int lc = tdefl_length_code(length);
+			int dc = tdefl_dist_code(dist);
+
+			tdefl_put_code(d, lcode[257 + lc], lengths[257 + lc]);
+			tdefl_put_bits(d, length - tdefl_length_base[lc], tdefl_length_bits[lc]);
+			tdefl_put_code(d, dcode[dc], lengths[286 + dc]);
+			tdefl_put_bits(d, dist - tdefl_dist_base[dc], tdefl_dist_bits[dc]);
+		}
+	}
+
+	tdefl_put_code(d, lcode[256], lengths[256]);
+	d->nsyms = 0;
+}
+
+#endif /* TDEFL_DYNAMIC == 1 */
+
+static void tdefl_symbol(struct tdefl_data *d, unsigned int lit,
+                         unsigned int length, unsigned int dist)
+{
+#if TDEFL_DYNAMIC == 1
+	d->sym_lit[d->nsyms] = dist ? length - 3 : lit;
+	d->sym_dist[d->nsyms] = dist;
+
+	if (++d->nsyms == TDEFL_BLOCK_SYMBOLS) {
+		tdefl_flush_block(d, 0);
+	}
+#else
+	tdefl_put_fixed_symbol(d, lit, length, dist);
+#endif
+}
+
+/* -- Matching -- */
+
+static unsigned int tdefl_hash(const unsigned char *p)
+{
+	unsigned int v = ((unsigned int) p[0] << 16) | (p[1] << 8) | p[2];
+
+	return (v * 2654435761U) >> (32 - TDEFL_HASH_BITS);
+}
+
+static void tdefl_insert(struct tdefl_data *d, unsigned int pos)
+{
+	unsigned int h;
+
+	if (pos + 3 > d->avail) {
+		return;
+	}
+
+	h = tdefl_hash(d->win + pos);
+	d->prev[pos & (TDEFL_WINDOW_SIZE - 1)] = d->head[h];
+	d->head[h] = (tdefl_pos) (pos + 1);
+}
+
+/* Longest match at d->pos, or 0 if there is none worth taking */
+static unsigned int tdefl_longest_match(struct tdefl_data *d, unsigned int *dist)
+{
+	const unsigned char *w = d->win;
+	unsigned int pos = d->pos;
+	unsigned int limit = d->avail - pos;
+	unsigned int best = 2;
+	unsigned int chain = TDEFL_MAX_CHAIN;
+	unsigned int cand;
+
+	if (limit < 3) {
+		return 0;
+	}
+
+	if (limit > 258) {
+		limit = 258;
+	}
+
+	cand = d->head[tdefl_hash(w + pos)];
+
+	/* Candidates come newest first, so the distance only grows */
+	while (cand && chain--) {
+		unsigned int c = cand - 1;
+
+		if (pos - c > d->max_dist) {
+			break;
+		}
+
+		if (w[c + best] == w[pos + best]) {
+			unsigned int len = 0;
+
+			while (len < limit && w[c + len] == w[pos + len]) {
+				++len;
+			}
+
+			if (len > best) {
+				best = len;
+				*dist = pos - c;
+
+				if (len == limit) {
+					break;
+				}
+			}
+		}
+
+		cand = d->prev[c & (TDEFL_WINDOW_SIZE - 1)];
+	}
+
+	/* A short match far away costs more than its literals */
+	if (best == 3 && *dist > 4096) {
+		return 0;
+	}
+
+	return best >= 3 ? best : 0;
+}
+
+/* Drop the older half of the window, once the lookahead runs short */
+static void tdefl_slide(struct tdefl_data *d)
+{
+	unsigned int i;
+
+#if TDEFL_STREAM == 1
+	if (d->feed) {
+		memmove(d->window, d->window + TDEFL_WINDOW_SIZE, d->avail - TDEFL_WINDOW_SIZE);
+	}
+	else
+#endif
+	{
+		d->win += TDEFL_WINDOW_SIZE;
+	}
+
+	d->pos -= TDEFL_WINDOW_SIZE;
+	d->avail -= TDEFL_WINDOW_SIZE;
+
+	for (i = 0; i < (1 << TDEFL_HASH_BITS); ++i) {
+		d->head[i] = d->head[i] > TDEFL_WINDOW_SIZE ? d->head[i] - TDEFL_WINDOW_SIZE : 0;
+	}
+
+	for (i = 0; i < TDEFL_WINDOW_SIZE; ++i) {
+		d->prev[i] = d->prev[i] > TDEFL_WINDOW_SIZE ? d->prev[i] - TDEFL_WINDOW_SIZE : 0;
+	}
+}
+
+/* Keep at least TDEFL_MIN_LOOKAHEAD bytes after d->pos until the input ends */
+static void tdefl_fill(struct tdefl_data *d)
+{
+	if (d->done || d->avail - d->pos >= TDEFL_MIN_LOOKAHEAD) {
+		return;
+	}
+
+	if (d->pos >= 2 * TDEFL_WINDOW_SIZE - TDEFL_MIN_LOOKAHEAD) {
+		tdefl_slide(d);
+	}
+
+#if TDEFL_STREAM == 1
+	if (d->feed) {
+		while (d->avail < 2 * TDEFL_WINDOW_SIZE) {
+			int c = d->feed(d->opaque);
+
+			if (c < 0) {
+				d->done = 1;
+				break;
+			}
+
+			d->window[d->avail++] = (unsigned char) c;
+		}
+
+		return;
+	}
+#endif
+#if TDEFL_BUFFER == 1
+	{
+		size_t left = (size_t) (d->source_end - d->win);
+
+		d->done = left <= 2 * TDEFL_WINDOW_SIZE;
+		d->avail = d->done ? (unsigned int) left : 2 * TDEFL_WINDOW_SIZE;
+	}
+#endif
+}
+
+/* Compress everything, d->win and the output must be set up */
+static int tdefl_run(struct tdefl_data *d)
+{
+#if TDEFL_LAZY == 1
+	unsigned int prev_len = 0, prev_dist = 0;
+	int have_prev = 0;
+#endif
+
+	d->pos = 0;
+	d->avail = 0;
+	d->done = 0;
+	d->bitbuf = 0;
+	d->bitcount = 0;
+	d->error = TDEFL_OK;
+	memset(d->head, 0, sizeof(d->head));
+	memset(d->prev, 0, sizeof(d->prev));
+
+#if TDEFL_DYNAMIC == 1
+	d->nsyms = 0;
+#else
+	/* One open ended fixed block, the final one is empty */
+	tdefl_put_bits(d, 2, 3);
+#endif
+
+	for (;;) {
+		unsigned int len, dist = 0;
+
+		tdefl_fill(d);
+
+		if (d->pos >= d->avail || d->error) {
+			break;
+		}
+
+		len = tdefl_longest_match(d, &dist);
+		tdefl_insert(d, d->pos);
+
+#if TDEFL_LAZY == 1
+		/* Take the previous match unless this one is longer */
+		if (have_prev && prev_len >= 3 && len <= prev_len) {
+			unsigned int end = d->pos - 1 + prev_len;
+
+			tdefl_symbol(d, 0, prev_len, prev_dist);
+
+			while (++d->pos < end) {
+				tdefl_insert(d, d->pos);
+			}
+
+			have_prev = 0;
+			continue;
+		}
+
+		if (have_prev) {
+			tdefl_symbol(d, d->win[d->pos - 1], 0, 0);
+		}
+
+		have_prev = 1;
+		prev_len = len;
+		prev_dist = dist;
+		d->pos++;
+#else
+		if (len >= 3) {
+			unsigned int end = d->pos + len;
+
+			tdefl_symbol(d, 0, len, dist);
+
+			while (++d->pos < end) {
+				tdefl_insert(d, d->pos);
+			}
+		}
+		else {
+			tdefl_symbol(d, d->win[d->pos], 0, 0);
+			d->pos++;
+		}
+#endif
+	}
+
+#if TDEFL_LAZY == 1
+	if (have_prev) {
+		tdefl_symbol(d, d->win[d->pos - 1], 0, 0);
+	}
+#endif
+
+#if TDEFL_DYNAMIC == 1
+	tdefl_flush_block(d, 1);
+#else
+	tdefl_put_code(d, 0, 7);
+	tdefl_put_bits(d, 3, 3);
+	tdefl_put_code(d, 0, 7);
+#endif
+
+	/* Pad the last byte */
+	tdefl_put_bits(d, 0, 7);
+
+	return d->error;
+}
+
+/* -- Public functions -- */
+
+#if TDEFL_BUFFER == 1
+int TDEFLCC tdefl_compress(void *dest, unsigned int *destLen,
+                           const void *source, unsigned int sourceLen)
+{
+	struct tdefl_data d;
+	int res;
+
+	d.win = (const unsigned char *) source;
+	d.source_end = d.win + sourceLen;
+	d.dest = (unsigned char *) dest;
+	d.dest_end = d.dest + *destLen;
+	d.max_dist = TDEFL_WINDOW_SIZE - 1;
+#if TDEFL_STREAM == 1
+	d.feed = 0;
+#endif
+
+	res = tdefl_run(&d);
+
+	*destLen = (unsigned int) (d.dest - (unsigned char *) dest);
+
+	return res;
+}
+#endif
+
+#if TDEFL_STREAM == 1
+int TDEFLCC tdefl_stream_compress_window( int (*feed)( void * ),
+	int (*produce)( void *, uint8_t ), void * opaque,
+	unsigned int window_bits )
+{
+	struct tdefl_data d;
+
+	d.win = d.window;
+	d.feed = feed;
+	d.produce = produce;
+	d.opaque = opaque;
+	d.max_dist = (1U << window_bits) - 1;
+
+	if (d.max_dist > TDEFL_WINDOW_SIZE - 1) {
+		d.max_dist = TDEFL_WINDOW_SIZE - 1;
+	}
+
+	return tdefl_run(&d);
+}
+
+int TDEFLCC tdefl_stream_compress( int (*feed)( void * ),
+	int (*produce)( void *, uint8_t ), void * opaque )
+{
+	return tdefl_stream_compress_window(feed, produce, opaque, 15);
+}
+#endif
+
+#endif /* TDEFL_IMPLEMENTATION */
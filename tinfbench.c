@@ -0,0 +1,425 @@
+// tinfbench - throughput benchmark for tinf_sf.h against zlib's inflate.
+//
+// Generates a reproducible corpus, compresses it with every window size
+// from 9 to 15 at a few levels, then times each decoder on it. Prints a
+// table and writes the results as JSON, so runs can be diffed between
+// versions of the header.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#endif
+
+// The ring has to hold the largest window we test.
+#define STREAM_BUFFER_BITS 15
+
+#include "common.h"
+
+#define NUM_CORPORA 4
+#define NUM_DECODERS 4
+
+static const char * corpus_names[NUM_CORPORA] = { "text", "binary", "zeros", "random" };
+static const int levels[] = { 1, 6, 9 };
+#define NUM_LEVELS ( sizeof( levels ) / sizeof( levels[0] ) )
+
+static uint32_t rng_state;
+
+static uint32_t rng( void )
+{
+	// xorshift32, so the corpus is the same everywhere.
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+static void gen_corpus( int which, uint8_t * out, size_t len )
+{
+	static const char * words[] = {
+		"the", "of", "and", "to", "in", "a", "is", "that", "for", "it",
+		"as", "was", "with", "be", "by", "on", "not", "he", "this", "are",
+		"or", "his", "from", "at", "which", "but", "have", "an", "had", "they",
+		"sensor", "packet", "window", "buffer", "stream", "decode", "value", "timeout",
+	};
+#define NUM_WORDS ( sizeof( words ) / sizeof( words[0] ) )
+	size_t i = 0;
+
+	rng_state = 0x9E3779B9u + which;
+
+	switch( which )
+	{
+	case 0:
+		// Words picked with a skewed distribution, in lines of varying length.
+		while( i < len )
+		{
+			uint32_t r = rng();
+			const char * w = words[ ( ( r & 0xff ) * ( ( r >> 8 ) & 0xff ) * NUM_WORDS ) >> 16 ];
+			while( *w && i < len ) out[i++] = *w++;
+			if( i < len ) out[i++] = ( ( r >> 16 ) % 12 ) ? ' ' : '\n';
+		}
+		break;
+	case 1:
+		// Fixed size records of counters, small deltas and flag bytes, like a
+		// table or machine code: lots of short matches at odd distances.
+		{
+			uint32_t counter = 0;
+			while( i < len )
+			{
+				uint32_t r = rng();
+				uint8_t rec[12];
+				counter += r & 0x1f;
+				memcpy( rec, &counter, 4 );
+				rec[4] = 0x48; rec[5] = 0x8b;
+				rec[6] = ( r >> 8 ) & 7;
+				rec[7] = ( r >> 12 ) & 0x3;
+				rec[8] = ( r >> 16 ) & 0xff;
+				rec[9] = rec[10] = rec[11] = 0;
+				size_t n = len - i < sizeof( rec ) ? len - i : sizeof( rec );
+				memcpy( out + i, rec, n );
+				i += n;
+			}
+		}
+		break;
+	case 2:
+		memset( out, 0, len );
+		break;
+	default:
+		for( ; i < len; i++ ) out[i] = rng() >> 24;
+		break;
+	}
+}
+
+static int raw_compress( uint8_t * dest, size_t * destLen, const uint8_t * src, size_t srcLen, int level, int w_bits )
+{
+	uLongf dl = *destLen;
+	int r = compress2window( dest, &dl, src, srcLen, level, w_bits );
+	*destLen = dl;
+	return r;
+}
+
+static int zlib_uncompress( uint8_t * dest, size_t * destLen, const uint8_t * src, size_t srcLen )
+{
+	z_stream s;
+	int r;
+	memset( &s, 0, sizeof( s ) );
+	if( inflateInit2( &s, -15 ) != Z_OK ) return -1;
+	s.next_in = (Bytef*)src;
+	s.avail_in = srcLen;
+	s.next_out = dest;
+	s.avail_out = *destLen;
+	r = inflate( &s, Z_FINISH );
+	*destLen = s.total_out;
+	inflateEnd( &s );
+	return r == Z_STREAM_END ? 0 : -1;
+}
+
+struct benchio
+{
+	const uint8_t * in;
+	size_t inplace, inlen;
+	uint8_t * out;
+	size_t outplace, outlen;
+};
+
+static int feedbyte( void * v )
+{
+	struct benchio * b = (struct benchio*)v;
+	if( b->inplace >= b->inlen ) return -1;
+	return b->in[b->inplace++];
+}
+
+static int producebyte( void * v, unsigned char c )
+{
+	struct benchio * b = (struct benchio*)v;
+	if( b->outplace >= b->outlen ) return -1;
+	b->out[b->outplace++] = c;
+	return 0;
+}
+
+static const uint8_t * feedblock( void * v, size_t * len )
+{
+	// Hand over the input in pieces the size of a typical read().
+	struct benchio * b = (struct benchio*)v;
+	size_t n = b->inlen - b->inplace;
+	if( n > 16384 ) n = 16384;
+	*len = n;
+	b->inplace += n;
+	return b->in + b->inplace - n;
+}
+
+static int producespan( void * v, const uint8_t * data, size_t len )
+{
+	struct benchio * b = (struct benchio*)v;
+	if( b->outplace + len > b->outlen ) return -1;
+	memcpy( b->out + b->outplace, data, len );
+	b->outplace += len;
+	return 0;
+}
+
+static const char * decoder_names[NUM_DECODERS] = {
+	"tinf_uncompress", "tinf_stream_uncompress", "tinf_stream_uncompress_blocks", "zlib_inflate" };
+
+static int run_decoder( int which, uint8_t * out, size_t outLen, const uint8_t * in, size_t inLen, size_t * produced )
+{
+	struct benchio b = { in, 0, inLen, out, 0, outLen };
+	unsigned int dl;
+	int r;
+
+	switch( which )
+	{
+	case 0:
+		dl = outLen;
+		r = tinf_uncompress( out, &dl, in, inLen );
+		*produced = dl;
+		return r;
+	case 1:
+		r = tinf_stream_uncompress( feedbyte, producebyte, &b );
+		*produced = b.outplace;
+		return r;
+	case 2:
+		r = tinf_stream_uncompress_blocks( feedblock, producespan, &b );
+		*produced = b.outplace;
+		return r;
+	default:
+		*produced = outLen;
+		return zlib_uncompress( out, produced, in, inLen );
+	}
+}
+
+static unsigned int zlib_crc32_update( unsigned int crc, const void * data, unsigned int len )
+{
+	return crc32( crc, data, len );
+}
+
+static unsigned int zlib_adler32_update( unsigned int adler, const void * data, unsigned int len )
+{
+	return adler32( adler, data, len );
+}
+
+// Checksums the gzip and zlib wrappers verify the output with, run over the
+// corpus in 64 KiB pieces like a stream would.
+// Each tinf checksum is followed by zlib's, which it is checked against.
+#define NUM_CHECKSUMS 4
+
+static const char * checksum_names[NUM_CHECKSUMS] = {
+	"tinf_crc32_update", "zlib_crc32", "tinf_adler32_update", "zlib_adler32" };
+
+static unsigned int ( * const checksum_funcs[NUM_CHECKSUMS] )( unsigned int, const void *, unsigned int ) = {
+	tinf_crc32_update, zlib_crc32_update, tinf_adler32_update, zlib_adler32_update };
+
+static const unsigned int checksum_init[NUM_CHECKSUMS] = { 0, 0, 1, 1 };
+
+static unsigned int run_checksum( int which, const uint8_t * data, size_t len )
+{
+	unsigned int sum = checksum_init[which];
+	size_t place;
+	for( place = 0; place < len; place += 65536 )
+		sum = checksum_funcs[which]( sum, data + place, len - place < 65536 ? len - place : 65536 );
+	return sum;
+}
+
+static double now( void )
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t cycles( void )
+{
+#ifdef HAVE_RDTSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+int main( int argc, char ** argv )
+{
+	size_t size = 1 << 20;
+	int reps = 5;
+	const char * jsonfile = "tinfbench.json";
+	int c;
+
+	while( ( c = getopt( argc, argv, "s:r:o:h" ) ) != -1 )
+	{
+		switch( c )
+		{
+		case 's':
+			size = strtoul( optarg, 0, 0 ) * 1024;
+			break;
+		case 'r':
+			reps = atoi( optarg );
+			break;
+		case 'o':
+			jsonfile = optarg;
+			break;
+		default:
+			fprintf( stderr, "Usage: tinfbench [-s corpus KiB] [-r repetitions] [-o results.json|-]\n" );
+			return -1;
+		}
+	}
+
+	if( size == 0 || reps < 1 )
+	{
+		fprintf( stderr, "Error: bad corpus size or repetition count\n" );
+		return -1;
+	}
+
+	uint8_t * corpus = malloc( size );
+	uint8_t * out = malloc( size );
+	size_t complen_max = size + size / 1000 + 1024;
+	uint8_t * comp = malloc( complen_max );
+	if( !corpus || !out || !comp )
+	{
+		fprintf( stderr, "Error: out of memory\n" );
+		return -1;
+	}
+
+	FILE * json = strcmp( jsonfile, "-" ) ? fopen( jsonfile, "w" ) : stdout;
+	if( !json )
+	{
+		fprintf( stderr, "Error: can't open %s\n", jsonfile );
+		return -1;
+	}
+
+	fprintf( json, "{\n\t\"corpus_bytes\": %zu,\n\t\"repetitions\": %d,\n\t\"fast_bits\": %d,\n\t\"results\": [", size, reps, TINF_FAST_BITS );
+
+	if( json != stdout )
+		printf( "%-7s %3s %3s %9s  %-30s %10s %8s\n", "corpus", "w", "lvl", "comp", "decoder", "MB/s", "cyc/B" );
+
+	int first = 1;
+	int failed = 0;
+	int corpusno;
+	for( corpusno = 0; corpusno < NUM_CORPORA; corpusno++ )
+	{
+		gen_corpus( corpusno, corpus, size );
+
+		int w;
+		for( w = 9; w <= 15; w++ )
+		{
+			unsigned l;
+			for( l = 0; l < NUM_LEVELS; l++ )
+			{
+				size_t complen = complen_max;
+				if( raw_compress( comp, &complen, corpus, size, levels[l], w ) != Z_OK )
+				{
+					fprintf( stderr, "Error: compression failed\n" );
+					return -1;
+				}
+
+				int d;
+				for( d = 0; d < NUM_DECODERS; d++ )
+				{
+					// Keep the fastest run, it's the one least disturbed by the system.
+					double best = 1e30;
+					uint64_t bestcycles = 0;
+					int rep;
+					for( rep = 0; rep < reps; rep++ )
+					{
+						size_t produced = 0;
+						double start = now();
+						uint64_t startcycles = cycles();
+						int r = run_decoder( d, out, size, comp, complen, &produced );
+						uint64_t endcycles = cycles();
+						double t = now() - start;
+						if( r || produced != size || memcmp( out, corpus, size ) )
+						{
+							fprintf( stderr, "Error: %s failed on %s w%d l%d (%d)\n",
+								decoder_names[d], corpus_names[corpusno], w, levels[l], r );
+							failed = 1;
+							break;
+						}
+						if( t < best )
+						{
+							best = t;
+							bestcycles = endcycles - startcycles;
+						}
+					}
+					if( rep < reps ) continue;
+
+					double mbs = size / best / 1e6;
+					double cpb = (double)bestcycles / size;
+
+					if( json != stdout )
+						printf( "%-7s %3d %3d %9zu  %-30s %10.1f %8.2f\n",
+							corpus_names[corpusno], w, levels[l], complen, decoder_names[d], mbs, cpb );
+
+					fprintf( json, "%s\n\t\t{ \"corpus\": \"%s\", \"window_bits\": %d, \"level\": %d, "
+						"\"compressed_bytes\": %zu, \"decoder\": \"%s\", \"mb_per_s\": %.2f, ",
+						first ? "" : ",", corpus_names[corpusno], w, levels[l], complen, decoder_names[d], mbs );
+#ifdef HAVE_RDTSC
+					fprintf( json, "\"cycles_per_byte\": %.3f }", cpb );
+#else
+					fprintf( json, "\"cycles_per_byte\": null }" );
+#endif
+					first = 0;
+				}
+			}
+		}
+	}
+
+	fprintf( json, "\n\t],\n\t\"crc32_fast\": %d,\n\t\"adler32_fast\": %d,\n\t\"checksums\": [",
+		TINF_CRC32_FAST, TINF_ADLER32_FAST );
+
+	if( json != stdout )
+		printf( "\n%-30s %10s %8s\n", "checksum", "MB/s", "cyc/B" );
+
+	first = 1;
+	for( c = 0; c < NUM_CHECKSUMS; c++ )
+	{
+		unsigned int want = run_checksum( c | 1, corpus, size );
+		double best = 1e30;
+		uint64_t bestcycles = 0;
+		int rep;
+		for( rep = 0; rep < reps; rep++ )
+		{
+			double start = now();
+			uint64_t startcycles = cycles();
+			unsigned int sum = run_checksum( c, corpus, size );
+			uint64_t endcycles = cycles();
+			double t = now() - start;
+			if( sum != want )
+			{
+				fprintf( stderr, "Error: %s disagrees with zlib\n", checksum_names[c] );
+				failed = 1;
+				break;
+			}
+			if( t < best )
+			{
+				best = t;
+				bestcycles = endcycles - startcycles;
+			}
+		}
+		if( rep < reps ) continue;
+
+		double mbs = size / best / 1e6;
+		double cpb = (double)bestcycles / size;
+
+		if( json != stdout )
+			printf( "%-30s %10.1f %8.2f\n", checksum_names[c], mbs, cpb );
+
+		fprintf( json, "%s\n\t\t{ \"checksum\": \"%s\", \"mb_per_s\": %.2f, ", first ? "" : ",", checksum_names[c], mbs );
+#ifdef HAVE_RDTSC
+		fprintf( json, "\"cycles_per_byte\": %.3f }", cpb );
+#else
+		fprintf( json, "\"cycles_per_byte\": null }" );
+#endif
+		first = 0;
+	}
+
+	fprintf( json, "\n\t]\n}\n" );
+	if( json != stdout ) fclose( json );
+
+	free( corpus );
+	free( out );
+	free( comp );
+	return failed;
+}
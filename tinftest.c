@@ -7,6 +7,10 @@
 
 #include "common.h"
 
+#define TDEFL_WINDOW_SIZE TINF_STREAM_BUFFER_SIZE
+#define TDEFL_IMPLEMENTATION
+#include "tdefl_sf.h"
+
 struct datagroup
 {
 	const uint8_t * data;
@@ -32,6 +36,15 @@ int producedata( void * v, unsigned char c )
 	return 0;
 }
 
+int producespan( void * v, const uint8_t * data, size_t len )
+{
+	struct datagroup * dg = (struct datagroup*)v;
+	if( dg->placeout + len > dg->lenout ) return -5;
+	memcpy( dg->dataOut + dg->placeout, data, len );
+	dg->placeout += len;
+	return 0;
+}
+
 int feeddata( void * v )
 {
 	struct datagroup * dg = (struct datagroup*)v;
@@ -39,6 +52,17 @@ int feeddata( void * v )
 	return dg->data[dg->place++];
 }
 
+const uint8_t * feedblock( void * v, size_t * len )
+{
+	// Hand out the data in odd-sized pieces to exercise run boundaries.
+	struct datagroup * dg = (struct datagroup*)v;
+	int remain = dg->len - dg->place;
+	if( remain > 1021 ) remain = 1021;
+	*len = remain;
+	dg->place += remain;
+	return dg->data + dg->place - remain;
+}
+
 struct filegroup
 {
 	FILE * fRead;
@@ -63,6 +87,19 @@ int feedfile( void * v )
 }
 
 
+// Deflate into a gzip/zlib/raw container picked by wbits, like deflateInit2.
+unsigned long deflatewrap( uint8_t * out, unsigned long outLen, const uint8_t * in, unsigned long inLen, int wbits, gz_header * head )
+{
+	z_stream zs = { 0 };
+	if( deflateInit2( &zs, 9, Z_DEFLATED, wbits, MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY ) != Z_OK ) return 0;
+	if( head ) deflateSetHeader( &zs, head );
+	zs.next_in = (Bytef*)in; zs.avail_in = inLen;
+	zs.next_out = out; zs.avail_out = outLen;
+	int r = deflate( &zs, Z_FINISH );
+	deflateEnd( &zs );
+	return r == Z_STREAM_END ? zs.total_out : 0;
+}
+
 int main()
 {
 	uint8_t * srcdata = (uint8_t*)"Hello world, how are you doing today today?";
@@ -137,7 +174,351 @@ int main()
 	}
 	printf( "Check passed\n" );
 
+	dg.place = 0;
+	dg.placeout = 0;
+	memset( uncompressed_test, 0, fLen );
+	r = tinf_stream_uncompress_spans( feeddata, producespan, &dg );
+	printf( "R tinf_stream_uncompress_spans: %d\n", r );
+	if( r ) return r;
+	if( dg.placeout != fLen || memcmp( uncompressed_input, uncompressed_test, fLen ) != 0 )
+	{
+		fprintf( stderr, "Error: Span check failed\n" );
+		return -57;
+	}
+	printf( "Span check passed\n" );
+
+	dg.place = 0;
+	dg.placeout = 0;
+	memset( uncompressed_test, 0, fLen );
+	r = tinf_stream_uncompress_blocks( feedblock, producespan, &dg );
+	printf( "R tinf_stream_uncompress_blocks: %d\n", r );
+	if( r ) return r;
+	if( dg.placeout != fLen || memcmp( uncompressed_input, uncompressed_test, fLen ) != 0 )
+	{
+		fprintf( stderr, "Error: Block feed check failed\n" );
+		return -58;
+	}
+	printf( "Block feed check passed\n" );
+
+#if TINF_PUSH == 1
+	// Push the data through in uneven fragments, with a small output buffer.
+	static struct tinf_data ctx;
+	unsigned int inpos = 0, outpos = 0;
+	tinf_stream_init( &ctx );
+	memset( uncompressed_test, 0, fLen );
+	do
+	{
+		unsigned int inlen = compedLen - inpos;
+		unsigned int outcap = fLen - outpos;
+		unsigned int consumed, produced;
+		if( inlen > 1000 ) inlen = 1000;
+		if( outcap > 777 ) outcap = 777;
+		r = tinf_stream_push( &ctx, compressed_test + inpos, inlen,
+			uncompressed_test + outpos, outcap, &consumed, &produced );
+		inpos += consumed;
+		outpos += produced;
+	} while( r == TINF_NEED_INPUT || r == TINF_NEED_OUTPUT );
+	printf( "R tinf_stream_push: %d\n", r );
+	if( r ) return r;
+	if( inpos != compedLen || outpos != fLen || memcmp( uncompressed_input, uncompressed_test, fLen ) != 0 )
+	{
+		fprintf( stderr, "Error: Push check failed\n" );
+		return -59;
+	}
+	printf( "Push check passed\n" );
+
+	// Only a range from the middle, with the start dropped inside tinf.
+	unsigned int rangeStart = fLen / 3 + 7, rangeLen = 100000;
+	tinf_stream_init_at( &ctx, 0, rangeStart, rangeLen );
+	inpos = outpos = 0;
+	do
+	{
+		unsigned int inlen = compedLen - inpos;
+		unsigned int consumed, produced;
+		if( inlen > 1000 ) inlen = 1000;
+		r = tinf_stream_push( &ctx, compressed_test + inpos, inlen,
+			uncompressed_test + outpos, 4096, &consumed, &produced );
+		inpos += consumed;
+		outpos += produced;
+	} while( r == TINF_NEED_INPUT || r == TINF_NEED_OUTPUT );
+	printf( "R tinf_stream_init_at: %d\n", r );
+	if( r ) return r;
+	if( outpos != rangeLen || memcmp( uncompressed_input + rangeStart, uncompressed_test, rangeLen ) != 0 )
+	{
+		fprintf( stderr, "Error: Range check failed\n" );
+		return -62;
+	}
+	printf( "Range check passed\n" );
+#endif
+
+	unsigned int destLen = fLen;
+	memset( uncompressed_test, 0, fLen );
+	r = tinf_uncompress( uncompressed_test, &destLen, compressed_test, compedLen );
+	printf( "R tinf_uncompress: %d\n", r );
+	if( r ) return r;
+	if( destLen != fLen || memcmp( uncompressed_input, uncompressed_test, fLen ) != 0 )
+	{
+		fprintf( stderr, "Error: Buffer mode check failed\n" );
+		return -56;
+	}
+	printf( "Buffer mode check passed\n" );
+
+	// Level 0 makes stored blocks only, which are copied in bulk.
+	unsigned long storedLen = fLen + fLen / 1000 + 64;
+	uint8_t * stored_test = malloc( storedLen );
+	r = compress2window( stored_test, &storedLen, uncompressed_input, srcLen, 0, STREAM_BUFFER_BITS );
+	printf( "Stored: %d / %ld / %ld\n", r, storedLen, srcLen );
+	dg.data = stored_test; dg.len = storedLen;
+	dg.place = 0;
+	dg.placeout = 0;
+	memset( uncompressed_test, 0, fLen );
+	r = tinf_stream_uncompress_blocks( feedblock, producespan, &dg );
+	printf( "R tinf_stream_uncompress_blocks (stored): %d\n", r );
+	if( r ) return r;
+	destLen = fLen;
+	if( dg.placeout != fLen || memcmp( uncompressed_input, uncompressed_test, fLen ) != 0 ||
+		tinf_uncompress( uncompressed_test, &destLen, stored_test, storedLen ) != TINF_OK ||
+		destLen != fLen || memcmp( uncompressed_input, uncompressed_test, fLen ) != 0 )
+	{
+		fprintf( stderr, "Error: Stored block check failed\n" );
+		return -60;
+	}
+	printf( "Stored block check passed\n" );
+
+	// A stored block cut off inside its LEN/NLEN header must fail cleanly.
+	int cut;
+	for( cut = 1; cut < 5; cut++ )
+	{
+		dg.data = stored_test; dg.len = cut;
+		dg.place = 0;
+		dg.placeout = 0;
+		destLen = fLen;
+		if( tinf_stream_uncompress( feeddata, producedata, &dg ) != TINF_DATA_ERROR ||
+			tinf_uncompress( uncompressed_test, &destLen, stored_test, cut ) != TINF_DATA_ERROR )
+		{
+			fprintf( stderr, "Error: Truncated stored block check failed at %d bytes\n", cut );
+			return -70;
+		}
+	}
+	printf( "Truncated stored block check passed\n" );
+
+	// A message compressed against a preset dictionary, here the window
+	// in front of it, decoded by seeding the ring and with buffer history.
+	const uint8_t * dict = uncompressed_input + 4096 - TINF_STREAM_BUFFER_SIZE;
+	const uint8_t * msg = uncompressed_input + 4096;
+	unsigned int msgLen = 2000;
+	uint8_t dictComped[4096];
+	z_stream zs = { 0 };
+	if( deflateInit2( &zs, 9, Z_DEFLATED, -STREAM_BUFFER_BITS, MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY ) != Z_OK ||
+		deflateSetDictionary( &zs, dict, TINF_STREAM_BUFFER_SIZE ) != Z_OK )
+		return -63;
+	zs.next_in = (Bytef*)msg; zs.avail_in = msgLen;
+	zs.next_out = dictComped; zs.avail_out = sizeof( dictComped );
+	if( deflate( &zs, Z_FINISH ) != Z_STREAM_END )
+		return -63;
+	printf( "Dictionary comped: %lu / %u\n", zs.total_out, msgLen );
+	dg.data = dictComped; dg.len = zs.total_out;
+	dg.place = 0;
+	dg.placeout = 0;
+	memset( uncompressed_test, 0, fLen );
+	r = tinf_stream_uncompress_dict( feeddata, producedata, &dg, dict, TINF_STREAM_BUFFER_SIZE );
+	printf( "R tinf_stream_uncompress_dict: %d\n", r );
+	if( r ) return r;
+	if( dg.placeout != msgLen || memcmp( msg, uncompressed_test, msgLen ) != 0 )
+	{
+		fprintf( stderr, "Error: Dictionary check failed\n" );
+		return -64;
+	}
+	memcpy( uncompressed_test, dict, TINF_STREAM_BUFFER_SIZE );
+	destLen = fLen - TINF_STREAM_BUFFER_SIZE;
+	if( tinf_uncompress_history( uncompressed_test + TINF_STREAM_BUFFER_SIZE, &destLen, dictComped, zs.total_out, TINF_STREAM_BUFFER_SIZE ) != TINF_OK ||
+		destLen != msgLen || memcmp( msg, uncompressed_test + TINF_STREAM_BUFFER_SIZE, msgLen ) != 0 )
+	{
+		fprintf( stderr, "Error: Dictionary check failed\n" );
+		return -64;
+	}
+	deflateEnd( &zs );
+	printf( "Dictionary check passed\n" );
+
+	// One caller-owned context, reused for a 512 byte and a 32 KiB window
+	// stream, and then for a stream that reaches back before its start,
+	// which must not see what the previous one left in the history.
+	{
+		struct tinf_data * ctx = malloc( sizeof( struct tinf_data ) );
+		uint8_t * history = malloc( 1 << 15 );
+		unsigned long len15 = fLen + fLen / 1000 + 64;
+		uint8_t * comp15 = malloc( len15 );
+		r = compress2window( comp15, &len15, uncompressed_input, srcLen, 9, 15 );
+		if( r ) return r;
+		int pass;
+		for( pass = 0; pass < 2; pass++ )
+		{
+			dg.data = pass ? comp15 : compressed_test; dg.len = pass ? len15 : compedLen;
+			dg.place = 0;
+			dg.placeout = 0;
+			memset( uncompressed_test, 0, fLen );
+			if( tinf_stream_set_history( ctx, history, pass ? 15 : STREAM_BUFFER_BITS ) != TINF_OK ||
+				( r = tinf_stream_decode( ctx, feeddata, producedata, &dg ) ) != TINF_OK ||
+				dg.placeout != fLen || memcmp( uncompressed_input, uncompressed_test, fLen ) != 0 )
+			{
+				fprintf( stderr, "Error: Context check failed on window %d (%d)\n", pass ? 15 : STREAM_BUFFER_BITS, r );
+				return -69;
+			}
+		}
+		dg.data = dictComped; dg.len = zs.total_out;
+		dg.place = 0;
+		dg.placeout = 0;
+		if( tinf_stream_decode( ctx, feeddata, producedata, &dg ) != TINF_DATA_ERROR ||
+			tinf_stream_set_history( ctx, history, 16 ) != TINF_STREAM_ERROR )
+		{
+			fprintf( stderr, "Error: Context check failed on a stale history\n" );
+			return -69;
+		}
+		free( comp15 );
+		free( history );
+		free( ctx );
+		printf( "Context check passed\n" );
+	}
+
+	// The incremental CRC32 over uneven pieces, at every alignment, against zlib's.
+	{
+		unsigned int crc = 0;
+		unsigned long place = 0, piece = 1;
+		while( place < fLen )
+		{
+			if( piece > fLen - place ) piece = fLen - place;
+			crc = tinf_crc32_update( crc, uncompressed_input + place, piece );
+			place += piece;
+			piece = piece * 3 % 4099 + 1;
+		}
+		if( crc != crc32( 0, uncompressed_input, fLen ) || tinf_crc32( uncompressed_input, fLen ) != crc ||
+			tinf_crc32_update( 0, uncompressed_input, 0 ) != 0 )
+		{
+			fprintf( stderr, "Error: CRC32 check failed\n" );
+			return -67;
+		}
+		printf( "CRC32 check passed\n" );
+	}
+
+	// And the same for Adler-32, whose vector code takes whole blocks.
+	{
+		unsigned int adler = 1;
+		unsigned long place = 0, piece = 1;
+		while( place < fLen )
+		{
+			if( piece > fLen - place ) piece = fLen - place;
+			adler = tinf_adler32_update( adler, uncompressed_input + place, piece );
+			place += piece;
+			piece = piece * 5 % 12007 + 1;
+		}
+		if( adler != adler32( 1, uncompressed_input, fLen ) || tinf_adler32( uncompressed_input, fLen ) != adler ||
+			tinf_adler32_update( 1, uncompressed_input, 0 ) != 1 )
+		{
+			fprintf( stderr, "Error: Adler-32 check failed\n" );
+			return -68;
+		}
+		printf( "Adler-32 check passed\n" );
+	}
+
+	// Two gzip members back to back (the second with a name and header crc,
+	// as pigz or cat would make them), then zlib, all through feed.
+	unsigned long wrapMax = fLen + fLen / 8 + 1024;
+	uint8_t * wrap_test = malloc( wrapMax );
+	gz_header gzh = { 0 };
+	gzh.name = (Bytef*)"gcc"; gzh.hcrc = 1;
+	unsigned long half = fLen / 2;
+	unsigned long gz1 = deflatewrap( wrap_test, wrapMax, uncompressed_input, half, 16 + STREAM_BUFFER_BITS, 0 );
+	unsigned long gz2 = gz1 ? deflatewrap( wrap_test + gz1, wrapMax - gz1, uncompressed_input + half, fLen - half, 16 + STREAM_BUFFER_BITS, &gzh ) : 0;
+	if( !gz2 ) return -65;
+	printf( "gzip: %lu + %lu / %ld\n", gz1, gz2, srcLen );
+	dg.data = wrap_test; dg.len = gz1 + gz2;
+	dg.place = 0;
+	dg.placeout = 0;
+	memset( uncompressed_test, 0, fLen );
+	r = tinf_stream_gzip_uncompress( feeddata, producedata, &dg );
+	printf( "R tinf_stream_gzip_uncompress: %d\n", r );
+	if( r ) return r;
+	destLen = fLen;
+	if( dg.placeout != fLen || memcmp( uncompressed_input, uncompressed_test, fLen ) != 0 ||
+		tinf_gzip_uncompress( uncompressed_test, &destLen, wrap_test, gz1 ) != TINF_OK ||
+		destLen != half || memcmp( uncompressed_input, uncompressed_test, half ) != 0 )
+	{
+		fprintf( stderr, "Error: gzip check failed\n" );
+		return -65;
+	}
+	// Checking without keeping the output.
+	dg.place = 0;
+	if( tinf_stream_gzip_uncompress( feeddata, 0, &dg ) != TINF_OK )
+	{
+		fprintf( stderr, "Error: gzip check without output failed\n" );
+		return -65;
+	}
+	// A bad CRC in the last trailer, and garbage after a member, have to be caught.
+	wrap_test[gz1 + gz2 - 8] ^= 1;
+	dg.place = 0;
+	dg.placeout = 0;
+	if( tinf_stream_gzip_uncompress( feeddata, producedata, &dg ) != TINF_DATA_ERROR )
+	{
+		fprintf( stderr, "Error: gzip check missed a bad crc\n" );
+		return -65;
+	}
+	wrap_test[gz1] = 0;
+	dg.place = 0;
+	dg.placeout = 0;
+	if( tinf_stream_gzip_uncompress( feeddata, producedata, &dg ) != TINF_DATA_ERROR )
+	{
+		fprintf( stderr, "Error: gzip check missed trailing garbage\n" );
+		return -65;
+	}
+	printf( "gzip check passed\n" );
+
+	unsigned long zlen = deflatewrap( wrap_test, wrapMax, uncompressed_input, fLen, STREAM_BUFFER_BITS, 0 );
+	dg.data = wrap_test; dg.len = zlen;
+	dg.place = 0;
+	dg.placeout = 0;
+	memset( uncompressed_test, 0, fLen );
+	r = tinf_stream_zlib_uncompress( feeddata, producedata, &dg );
+	printf( "R tinf_stream_zlib_uncompress: %d\n", r );
+	if( r ) return r;
+	destLen = fLen;
+	if( !zlen || dg.placeout != fLen || memcmp( uncompressed_input, uncompressed_test, fLen ) != 0 ||
+		tinf_zlib_uncompress( uncompressed_test, &destLen, wrap_test, zlen ) != TINF_OK || destLen != fLen )
+	{
+		fprintf( stderr, "Error: zlib check failed\n" );
+		return -66;
+	}
+	wrap_test[zlen - 1] ^= 1;
+	dg.place = 0;
+	dg.placeout = 0;
+	if( tinf_stream_zlib_uncompress( feeddata, producedata, &dg ) != TINF_DATA_ERROR )
+	{
+		fprintf( stderr, "Error: zlib check missed a bad adler32\n" );
+		return -66;
+	}
+	printf( "zlib check passed\n" );
+
+	// tdefl with the same window has to produce something the stream decoder takes.
+	unsigned int tdeflLen = fLen + fLen / 8 + 64;
+	uint8_t * tdefl_test = malloc( tdeflLen );
+	r = tdefl_compress( tdefl_test, &tdeflLen, uncompressed_input, srcLen );
+	printf( "tdefl: %d / %u / %ld (%.2f %%)\n", r, tdeflLen, srcLen, 100.*(float)tdeflLen/(float)srcLen );
+	if( r ) return r;
+	dg.data = tdefl_test; dg.len = tdeflLen;
+	dg.place = 0;
+	dg.placeout = 0;
+	memset( uncompressed_test, 0, fLen );
+	r = tinf_stream_uncompress( feeddata, producedata, &dg );
+	printf( "R tinf_stream_uncompress (tdefl): %d\n", r );
+	if( r ) return r;
+	if( dg.placeout != fLen || memcmp( uncompressed_input, uncompressed_test, fLen ) != 0 )
+	{
+		fprintf( stderr, "Error: tdefl check failed\n" );
+		return -61;
+	}
+	printf( "tdefl check passed\n" );
+
 	printf( "Context Decode Size (Bytes): %ld\n", sizeof( struct tinf_data ) );
+	printf( "Context Encode Size (Bytes): %ld\n", sizeof( struct tdefl_data ) );
 
 /*
 	struct filegroup fg;